@@ -45,18 +45,26 @@
 #ifndef SYSCONFDIR
 # define SYSCONFDIR "/etc/local"
 #endif
-/** Default keyboard config path */
-#define KB_FULL_PATH SYSCONFDIR "/layouts/keyboard.xml"
+/** Default keyboard config path, set by build */
+#ifndef KB_FULL_PATH
+# define KB_FULL_PATH SYSCONFDIR "/layouts/keyboard.xml"
+#endif
 /** Keyboard max factor. Keyboard takes at most 1/3 of the screen height */
 #define KB_HEIGHTMAX_FACTOR 3
 /** mm to inch conversion multiplier */
 #define MM_TO_IN 0.0393701
+/** Minimum screen resolution for 300 dpi key images */
+#define KB_DPI_HIGH 290
+/** Minimum screen resolution for 200 dpi key images */
+#define KB_DPI_MEDIUM 200
 /** Preferred key button height in inches */
 #define KB_KEYHEIGHT_PREF (double) (8 * MM_TO_IN)
 /** Config file name */
 #define CONFIG_FILE "kterm.conf"
 /** Default config file path */
 #define CONFIG_FULL_PATH SYSCONFDIR "/kterm/" CONFIG_FILE
+/** Delay in ms after last config file change before config is reloaded */
+#define CONFIG_RELOAD_DEBOUNCE_MS 300
 
 /** Resize font up */
 #define FONT_UP 0
@@ -78,6 +86,47 @@
 
 /** Delay for key release event */
 #define KB_RELEASE_DELAY_MS 100
+/** Releases due within this time are sent together */
+#define KB_RELEASE_COALESCE_MS 10
+/** Default delay before key starts repeating */
+#define KB_REPEAT_DELAY_MS 500
+/** Max time in ms between modifier taps to latch modifier */
+#define KB_DOUBLE_TAP_MS 400
+/** Hold time in ms before key alternates popup is shown */
+#define KB_LONG_PRESS_MS 400
+/** Min upward swipe distance in mm sending shifted key variant */
+#define KB_SWIPE_MM 4
+/** Default initial key repeat interval */
+#define KB_REPEAT_INTERVAL_MS 150
+/** Default key repeat acceleration, interval decrease in percent per repeat */
+#define KB_REPEAT_ACCEL 10
+/** Minimum key repeat interval */
+#define KB_REPEAT_MIN_MS 30
+/** Minimum time between repeat batches sent to terminal */
+#define KB_REPEAT_BATCH_MS 60
+/** Delay merging keyboard size updates during relayout */
+#define KB_RESIZE_DEBOUNCE_MS 50
+/** Delay in ms after last layout file change before layout is reloaded */
+#define KB_RELOAD_DEBOUNCE_MS 300
+/** Default radius in mm for snapping touches to nearest key */
+#define KB_SLOP_MM 2
+/** Canvas keyboard key padding in pixels */
+#define KB_CANVAS_PADDING 3
+
+/** Count of suggestions shown */
+#define SUGGEST_COUNT 4
+/** Max count of suggestion trie nodes */
+#define SUGGEST_NODES_MAX 65536
+/** Max count of trie nodes visited in one suggestion lookup */
+#define SUGGEST_VISIT_MAX 4096
+/** Max length of suggested word */
+#define SUGGEST_WORD_MAX 128
+/** Min length of word added to suggestions */
+#define SUGGEST_WORD_MIN 3
+/** Min length of typed prefix to show suggestions */
+#define SUGGEST_PREFIX_MIN 2
+/** Max count of history lines indexed in one idle callback */
+#define SUGGEST_INDEX_LINES 200
 
 /** Terminal scrollback size */
 #define VTE_SCROLLBACK_LINES 200
@@ -102,6 +151,15 @@ extern gboolean debug;
 /** Kterm config */
 typedef struct {
     gboolean kb_on; /** Keyboard visibility */
+    gboolean kb_canvas; /** Keyboard painted on single canvas widget */
+    guint kb_slop; /** Radius in mm for snapping touches to nearest key */
+    gboolean kb_direct; /** Keyboard writes input sequences directly to terminal */
+    guint kb_repeat_delay; /** Delay in ms before key starts repeating */
+    guint kb_repeat_interval; /** Initial key repeat interval in ms, zero disables repeat */
+    guint kb_repeat_accel; /** Key repeat interval decrease in percent per repeat */
+    gboolean kb_reload; /** Keyboard layout is reloaded when layout file changes */
+    gboolean kb_suggest; /** Suggestion strip is shown above keyboard */
+    gboolean kb_suggest_save; /** Suggestion index is saved to user cache directory */
     gboolean color_reversed; /** Color scheme, is reversed */
     gchar font_family[50]; /** Terminal font family */
     guint font_size;  /** Terminal font size */
@@ -113,5 +171,6 @@ typedef struct {
 } KTconf;
 
 KTconf * parse_config(void);
+void config_path(gchar *conf_path, gsize size);
 
 #endif
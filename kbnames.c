@@ -0,0 +1,291 @@
+/* kbnames.c
+ *
+ * This file is part of kterm
+ *
+ * Copyright(C) 2016 Bartek Fabiszewski (www.fabiszewski.net)
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Perfect hash lookup of key and modifier names, used when gperf is not found.
+ * Hash and table are written out for the key list in kbnames.gperf
+ * and must be kept in sync with it. "make kbnames-update" replaces
+ * this file with gperf output, "make check" fails if it is older than kbnames.gperf.
+ */
+
+#include <string.h>
+#include "keyboard.h"
+
+#define TOTAL_KEYWORDS 58
+#define MIN_WORD_LENGTH 2
+#define MAX_WORD_LENGTH 10
+#define MAX_HASH_VALUE 197
+
+/**
+ * Hash name
+ * @param str Name
+ * @param len Name length
+ * @return Hash value
+ */
+static unsigned int kbname_hash(const char *str, size_t len) {
+    static const unsigned char asso_values[] = {
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198,
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198,
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198,
+          1,   8,  61,  48,  18,  30,  45,   0,  29,  24, 198, 198, 198, 198, 198, 198,
+        198,  77,  25,  60,   0,  28,  21,  28,   0,   0, 198,   0,  22,  44,   0,   0,
+         35,   0,  42,  81,  49,   0, 198,   0,   0,   0, 198, 198, 198, 198, 198, 198,
+        198,  77,  25,  60,   0,  28,  21,  28,   0,   0, 198,   0,  22,  44,   0,   0,
+         35,   0,  42,  81,  49,   0, 198,   0,   0,   0, 198, 198, 198, 198, 198, 198,
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198,
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198,
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198,
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198,
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198,
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198,
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198,
+        198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198, 198
+    };
+    unsigned int hval = (unsigned int) len;
+    switch (hval) {
+        default:
+            hval += asso_values[(unsigned char) str[2]];
+            /* FALLTHROUGH */
+        case 2:
+            hval += asso_values[(unsigned char) str[1]];
+            break;
+    }
+    return hval + asso_values[(unsigned char) str[len - 1]];
+}
+
+/**
+ * Look up key or modifier name, case insensitive
+ * @param str Name
+ * @param len Name length
+ * @return Lookup entry, null if not found
+ */
+const struct kbnamelookup * kbname_lookup(const char *str, size_t len) {
+    static const struct kbnamelookup kbname_list[] = {
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f7", KB_KEY(F7), 0 },
+        { "end", KB_KEY(End), 0 },
+        { "down", KB_KEY(Down), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "linefeed", KB_KEY(Linefeed), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f17", KB_KEY(F17), 0 },
+        { "mod1", KB_KEY(Meta_L), GDK_MOD2_MASK },
+        { "f10", KB_KEY(F10), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f1", KB_KEY(F1), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f11", KB_KEY(F11), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "menu", KB_KEY(Menu), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f4", KB_KEY(F4), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f14", KB_KEY(F14), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f9", KB_KEY(F9), 0 },
+        { "numlock", KB_KEY(Num_Lock), 0 },
+        { "mod3", KB_KEY(Hyper_L), GDK_MOD4_MASK },
+        { NULL, 0, 0 },
+        { "shift", KB_KEY(Shift_L), GDK_SHIFT_MASK },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f19", KB_KEY(F19), 0 },
+        { "f8", KB_KEY(F8), 0 },
+        { "begin", KB_KEY(Begin), 0 },
+        { "f5", KB_KEY(F5), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "mod2", KB_KEY(Super_L), GDK_MOD3_MASK },
+        { "f20", KB_KEY(F20), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f18", KB_KEY(F18), 0 },
+        { NULL, 0, 0 },
+        { "f15", KB_KEY(F15), 0 },
+        { "up", KB_KEY(Up), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "break", KB_KEY(Break), 0 },
+        { "home", KB_KEY(Home), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f21", KB_KEY(F21), 0 },
+        { "next", KB_KEY(Next), 0 },
+        { "right", KB_KEY(Right), 0 },
+        { "return", KB_KEY(Return), 0 },
+        { "delete", KB_KEY(Delete), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "sysreq", KB_KEY(Sys_Req), 0 },
+        { NULL, 0, 0 },
+        { "prior", KB_KEY(Prior), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f6", KB_KEY(F6), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "print", KB_KEY(Print), 0 },
+        { "clear", KB_KEY(Clear), 0 },
+        { "f3", KB_KEY(F3), 0 },
+        { NULL, 0, 0 },
+        { "f24", KB_KEY(F24), 0 },
+        { "f16", KB_KEY(F16), 0 },
+        { "left", KB_KEY(Left), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f13", KB_KEY(F13), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "pause", KB_KEY(Pause), 0 },
+        { NULL, 0, 0 },
+        { "scrolllock", KB_KEY(Scroll_Lock), 0 },
+        { "pagedown", KB_KEY(Page_Down), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "ctrl", KB_KEY(Control_L), GDK_CONTROL_MASK },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "alt", KB_KEY(Alt_L), GDK_MOD1_MASK },
+        { "f2", KB_KEY(F2), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "tab", KB_KEY(Tab), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f12", KB_KEY(F12), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "insert", KB_KEY(Insert), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "space", KB_KEY(space), 0 },
+        { "pageup", KB_KEY(Page_Up), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f23", KB_KEY(F23), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "backspace", KB_KEY(BackSpace), 0 },
+        { "escape", KB_KEY(Escape), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "f22", KB_KEY(F22), 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { NULL, 0, 0 },
+        { "caps", KB_KEY(Caps_Lock), GDK_LOCK_MASK },
+    };
+    if (len <= MAX_WORD_LENGTH && len >= MIN_WORD_LENGTH) {
+        unsigned int key = kbname_hash(str, len);
+        if (key <= MAX_HASH_VALUE) {
+            const char *s = kbname_list[key].name;
+            if (s && !g_ascii_strncasecmp(str, s, len) && s[len] == '\0') {
+                return &kbname_list[key];
+            }
+        }
+    }
+    return NULL;
+}
@@ -26,6 +26,9 @@
 #include "keyboard.h"
 #include "config.h"
 
+/** Global config */
+extern KTconf *conf;
+
 #if GTK_CHECK_VERSION(3,0,0)
 /** 
  * Get gdk keyboard device
@@ -81,123 +84,326 @@ static gboolean modifier_only_caps(const Keyboard *keyboard) {
 }
 
 /**
- * Set layout variant based on modifiers set
+ * Get display state based on modifiers set
  * @param keyboard Keyboard structure
+ * @return Display state, one of layout variants or KB_STATE_CAPS
  */
-static void keyboard_set_layout(const Keyboard *keyboard) {
-    KBtype kb_type = kbstate_to_kbtype(keyboard->modifier_mask);
-    gboolean only_caps = modifier_only_caps(keyboard);
-    D printf("setting layout %d, caps: %i\n", kb_type, only_caps);
+static guint keyboard_state(const Keyboard *keyboard) {
+    if (modifier_only_caps(keyboard)) {
+        return KB_STATE_CAPS;
+    }
+    return kbstate_to_kbtype(keyboard->modifier_mask);
+}
+
+/**
+ * Get layout variant displayed on key in given display state
+ * @param key Key structure
+ * @param state Display state, one of layout variants or KB_STATE_CAPS
+ * @return Layout variant, falls back to default if variant has no label/image
+ */
+KBtype keyboard_key_face(const Key *key, guint state) {
+    KBtype type = KBT_DEFAULT;
+    if (state == KB_STATE_CAPS) {
+        type = key->obey_caps ? KBT_SHIFT : KBT_DEFAULT;
+    } else if (state < KBT_COUNT) {
+        type = (KBtype) state;
+    }
+    if (!key->image_path[type] && !key->label[type]) {
+        type = KBT_DEFAULT;
+    }
+    return type;
+}
+
+/**
+ * Set key button label/image for layout variant
+ * @param key Key structure
+ * @param type Layout variant
+ */
+static void keyboard_key_set_face(Key *key, KBtype type) {
+    keyboard_key_materialize(key, type);
+    if (!key->button) {
+        keyboard_canvas_queue_key(key);
+        return;
+    }
+    if (key->image[type]) {
+        if (key->image[type] != gtk_button_get_image(GTK_BUTTON(key->button))) {
+            g_object_ref(key->image[type]);
+            gtk_button_set_image(GTK_BUTTON(key->button), key->image[type]);
+            gtk_button_set_image_position(GTK_BUTTON(key->button), GTK_POS_BOTTOM);
+        }
+        if (gtk_button_get_label(GTK_BUTTON(key->button))) {
+            gtk_button_set_label(GTK_BUTTON(key->button), NULL);
+        }
+    } else if (key->label[type]) {
+        if (key->label[type] != gtk_button_get_label(GTK_BUTTON(key->button))) {
+            gtk_button_set_label(GTK_BUTTON(key->button), key->label[type]);
+        }
+        if (gtk_button_get_image(GTK_BUTTON(key->button))) {
+            gtk_button_set_image(GTK_BUTTON(key->button), NULL);
+        }
+    }
+}
+
+/**
+ * Set layout variant based on modifiers set.
+ * Only keys which differ between current and new state are updated,
+ * window updates are frozen, so that all changes are drawn at once.
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_set_layout(Keyboard *keyboard) {
+    guint state = keyboard_state(keyboard);
+    if (state == keyboard->layout_state) {
+        return;
+    }
+    gint64 start = g_get_monotonic_time();
+    guint previous = keyboard->layout_state;
+    Key **diff = keyboard->layout_diff[previous][state];
+    guint count = keyboard->layout_diff_count[previous][state];
+    keyboard->layout_state = state;
+    GdkWindow *window = gtk_widget_get_window(keyboard->container);
+    if (window) { gdk_window_freeze_updates(window); }
+    for (guint i = 0; i < count; i++) {
+        Key *key = diff[i];
+        keyboard_key_set_face(key, keyboard_key_face(key, state));
+    }
+    if (window) { gdk_window_thaw_updates(window); }
+    D printf("setting layout %u -> %u: %u keys updated in %" G_GINT64_FORMAT " us\n",
+             previous, state, count, g_get_monotonic_time() - start);
+}
+
+/**
+ * Get widget receiving events for key
+ * @param key Key structure
+ * @return Button widget or keyboard canvas
+ */
+static GtkWidget * keyboard_key_widget(const Key *key) {
+    return key->button ? key->button : key->keyboard->widget;
+}
+
+/**
+ * Is key pressed
+ * @param key Key structure
+ * @return True if key is active
+ */
+static gboolean keyboard_key_get_active(const Key *key) {
+    if (key->button) {
+        return gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(key->button));
+    }
+    return key->active;
+}
+
+/**
+ * Set key pressed state
+ * @param key Key structure
+ * @param active True to press, false to release
+ */
+static void keyboard_key_set_active(Key *key, gboolean active) {
+    if (key->button) {
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(key->button), active);
+    } else if (key->active != active) {
+        key->active = active;
+        keyboard_canvas_queue_key(key);
+    }
+}
+
+/**
+ * Resolve keymap entries of all keys and keyboard device for key event template
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_keymap_resolve(Keyboard *keyboard) {
+    gint64 start = g_get_monotonic_time();
+    GdkKeymap *keymap = gdk_keymap_get_default();
     for (guint i = 0; i < keyboard->key_count; i++) {
-        Key *key = keyboard->keys[i];
-        KBtype type = kb_type;
-        if (only_caps && !key->obey_caps) {
-            type = KBT_DEFAULT;
-        }
-        if (key->image[type]) {
-            if (key->image[type] != gtk_button_get_image(GTK_BUTTON(key->button))) {
-                g_object_ref(key->image[type]);
-                gtk_button_set_image(GTK_BUTTON(key->button), key->image[type]);
-                gtk_button_set_image_position(GTK_BUTTON(key->button), GTK_POS_BOTTOM);
-            }
-            if (gtk_button_get_label(GTK_BUTTON(key->button))) {
-                gtk_button_set_label(GTK_BUTTON(key->button), NULL);
-            }
-        } else if (key->label[type]) {
-            if (key->label[type] != gtk_button_get_label(GTK_BUTTON(key->button))) {
-                gtk_button_set_label(GTK_BUTTON(key->button), key->label[type]);
-            }
-            if (gtk_button_get_image(GTK_BUTTON(key->button))) {
-                gtk_button_set_image(GTK_BUTTON(key->button), NULL);
+        Key *key = &keyboard->keys[i];
+        for (gint type = 0; type < KBT_COUNT; type++) {
+            GdkKeymapKey *keys = NULL;
+            gint n_keys = 0;
+            KBkeymap *map = &key->keymap[type];
+            map->valid = FALSE;
+            if (key->keyval[type] && gdk_keymap_get_entries_for_keyval(keymap, key->keyval[type], &keys, &n_keys)) {
+                map->keycode = (guint16) keys[0].keycode;
+                map->group = (guint8) keys[0].group;
+                map->level = (guint8) keys[0].level;
+                map->valid = TRUE;
+                g_free(keys);
             }
         }
     }
+    if (keyboard->key_event == NULL) {
+        keyboard->key_event = gdk_event_new(GDK_KEY_PRESS);
+    }
+#if GTK_CHECK_VERSION(3,0,0)
+    // gtk3 complains about fake device
+    gdk_event_set_device(keyboard->key_event, getkbdevice());
+#endif
+    keyboard->keymap_valid = TRUE;
+    D printf("keymap resolved in %" G_GINT64_FORMAT " us\n", g_get_monotonic_time() - start);
+}
+
+/**
+ * Keymap keys-changed signal handler, invalidates resolved keymap entries
+ * @param keymap Keymap
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_keymap_changed_cb(GdkKeymap *keymap, Keyboard *keyboard) {
+    UNUSED(keymap);
+    D printf("keymap changed\n");
+    keyboard->keymap_valid = FALSE;
 }
 
 /**
- * Send synthetized key event
+ * Send synthetized key event.
+ * Event is copied from template with keymap entries resolved at layout load.
+ * Toplevel window is looked up for each event, as it may be realized again (rotation, remap),
+ * and each event is a separate copy, as handlers may send keys again.
  * @param key Key structure
  * @param event_type Gdk key event type (press or release)
  * @param keystate Key state
- * @param keyval Key value
+ * @param type Layout variant of sent keyval
  * @return True on success, false otherwise
  */
-static gboolean send_key_event(Key *key, GdkEventType event_type, guint keystate, guint keyval) {
-    GdkKeymapKey *keys = NULL;
-    gint n_keys = 0;
-    if (!gdk_keymap_get_entries_for_keyval(gdk_keymap_get_default(), keyval, &keys, &n_keys)) {
+static gboolean send_key_event(Key *key, GdkEventType event_type, guint keystate, KBtype type) {
+    Keyboard *keyboard = key->keyboard;
+    gint64 start = g_get_monotonic_time();
+    if G_UNLIKELY(!keyboard->keymap_valid) {
+        keyboard_keymap_resolve(keyboard);
+    }
+    const KBkeymap *map = &key->keymap[type];
+    if (!map->valid) {
         return FALSE;
     }
-    GdkEvent *event = gdk_event_new(event_type);
-    event->key.window = g_object_ref(gtk_widget_get_window(GTK_WIDGET(key->button)));
+    GtkWidget *toplevel = gtk_widget_get_toplevel(keyboard_key_widget(key));
+    GdkWindow *window = gtk_widget_get_window(toplevel);
+    if (window == NULL) {
+        return FALSE;
+    }
+    GdkEvent *event = gdk_event_copy(keyboard->key_event);
+    event->key.window = g_object_ref(window);
+    event->type = event_type;
     event->key.state = keystate;
-    if (!key->modifier) { event->key.state |= (guint) keys[0].level; }
-    event->key.hardware_keycode = (guint16) keys[0].keycode;
-    event->key.keyval = keyval;
+    if (!key->modifier) { event->key.state |= map->level; }
+    event->key.hardware_keycode = map->keycode;
+    event->key.keyval = key->keyval[type];
     event->key.send_event = FALSE;
     event->key.time = gtk_get_current_event_time();
     event->key.is_modifier = (key->modifier != 0);
-    event->key.group = (guint8) keys[0].group;
-#if GTK_CHECK_VERSION(3,0,0)
-    // gtk3 complains about fake device
-    gdk_event_set_device(event, getkbdevice());
-#endif
-    g_free(keys);
+    event->key.group = map->group;
     gtk_main_do_event(event);
     gdk_event_free(event);
+    D {
+        gint64 elapsed = g_get_monotonic_time() - start;
+        keyboard->event_count++;
+        keyboard->event_time += elapsed;
+        printf("key event sent in %" G_GINT64_FORMAT " us (average %" G_GINT64_FORMAT " us over %u events)\n",
+               elapsed, keyboard->event_time / keyboard->event_count, keyboard->event_count);
+    }
     return TRUE;
 }
 
 /**
- * Deactivate modifier buttons based on modifiers set
+ * Set pressed state of all keys of modifier
  * @param keyboard Keyboard structure
+ * @param modifier Modifier type
+ * @param active True to press, false to release
  */
-static void keyboard_reset_modifiers(Keyboard *keyboard) {
-    D printf("resetting modifier_mask\n");
-    for (guint i = 0; i < keyboard->key_count; i++) {
-        Key *key = keyboard->keys[i];
-        if (key->modifier && (keyboard->modifier_mask & key->modifier) && key->modifier != GDK_LOCK_MASK) {
-            if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(key->button))) {
-                gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(key->button), FALSE);
-                send_key_event(key, GDK_KEY_RELEASE, 1, key->keyval[KBT_DEFAULT]);
+static void keyboard_modifier_set_active(Keyboard *keyboard, guint32 modifier, gboolean active) {
+    const gint bit = g_bit_nth_lsf(modifier, -1);
+    if (bit < 0 || bit >= KB_MODIFIER_BITS) {
+        return;
+    }
+    for (guint i = 0; i < keyboard->modifier_key_count[bit]; i++) {
+        Key *key = keyboard->modifier_keys[bit][i];
+        if (keyboard_key_get_active(key) != active) { keyboard_key_set_active(key, active); }
+    }
+}
+
+/**
+ * Deactivate modifier buttons based on modifiers set.
+ * Only keys of set modifiers are visited, using modifier index.
+ * Caps lock is kept, latched and locked modifiers are kept unless requested.
+ * @param keyboard Keyboard structure
+ * @param latched Also reset latched and locked modifiers
+ */
+static void keyboard_reset_modifiers(Keyboard *keyboard, gboolean latched) {
+    const guint32 keep = GDK_LOCK_MASK | (latched ? 0 : keyboard->modifier_latched);
+    const guint32 reset = keyboard->modifier_mask & ~keep;
+    D printf("resetting modifier_mask: %u\n", reset);
+    for (guint bit = 0; bit < KB_MODIFIER_BITS; bit++) {
+        if (!(reset & (1U << bit))) { continue; }
+        gboolean released = FALSE;
+        for (guint i = 0; i < keyboard->modifier_key_count[bit]; i++) {
+            Key *key = keyboard->modifier_keys[bit][i];
+            if (keyboard_key_get_active(key)) {
+                keyboard_key_set_active(key, FALSE);
+                // one release for modifier, even if several keys show it
+                if (!keyboard->direct && !released) { send_key_event(key, GDK_KEY_RELEASE, 1, KBT_DEFAULT); }
+                released = TRUE;
             }
         }
     }
-    keyboard->modifier_mask &= GDK_LOCK_MASK;
+    keyboard->modifier_mask &= keep;
+    keyboard->modifier_latched &= keep;
 }
 
 /**
- * Calculate and set key button sizes
- * @param data Keyboard structure
- * @return Always false to cancel timeout, as called with g_timeout_add();
+ * Modifier key press.
+ * Tap sets one-shot modifier, reset after next key. Second tap within KB_DOUBLE_TAP_MS
+ * latches modifier for following keys. Lock keys and caps lock are set until tapped again.
+ * @param key Modifier key structure
+ * @return True on success, false otherwise
  */
-gboolean keyboard_set_size(gpointer data) {
-    Keyboard *keyboard = data;
-    if G_UNLIKELY(keyboard == NULL || keyboard->key_count == 0 || keyboard->row_count == 0) {
-        return FALSE;
+static gboolean keyboard_modifier_press(Key *key) {
+    Keyboard *keyboard = key->keyboard;
+    const gint64 now = g_get_monotonic_time();
+    const gboolean double_tap = (keyboard->modifier_tap == key && now - keyboard->modifier_tap_time < KB_DOUBLE_TAP_MS * 1000);
+    const guint key_state = (keyboard->modifier_mask & KB_MODIFIERS_BASIC_MASK);
+    GdkEventType event_type = GDK_KEY_PRESS;
+    keyboard->modifier_tap = key;
+    keyboard->modifier_tap_time = now;
+    if (keyboard->modifier_mask & key->modifier) {
+        if (double_tap && !(keyboard->modifier_latched & key->modifier)) {
+            // modifier stays set, no event or layout change
+            keyboard->modifier_latched |= key->modifier;
+            D printf("modifier latched: %u\n", key->modifier);
+            return TRUE;
+        }
+        event_type = GDK_KEY_RELEASE;
+        keyboard->modifier_mask &= ~key->modifier;
+        keyboard->modifier_latched &= ~key->modifier;
+        keyboard->modifier_tap = NULL;
+    } else {
+        keyboard->modifier_mask |= key->modifier;
+        if (key->lock || key->modifier == GDK_LOCK_MASK) {
+            keyboard->modifier_latched |= key->modifier;
+        }
     }
-    GtkWidget *keyboard_box = keyboard->container;
-    // update geometry
-    GdkScreen *screen = gdk_screen_get_default();
-    gint screen_height = gdk_screen_get_height(screen);
-    gint screen_width = gdk_screen_get_width(screen);
-    GtkWidget *window = gtk_widget_get_toplevel(keyboard_box);
-    GtkAllocation* alloc = g_new(GtkAllocation, 1);
-    gtk_widget_get_allocation(window, alloc);
-    gint window_width = alloc->width;
-    gint window_height = alloc->height;
-    g_free(alloc);
-    gboolean is_portrait = FALSE;
-    if (window_width < screen_height) {
-        is_portrait = TRUE;
+    keyboard_modifier_set_active(keyboard, key->modifier, event_type == GDK_KEY_PRESS);
+    D printf("modifier: %u\n", key->modifier);
+    D printf("modifier_mask: %u (latched %u)\n", keyboard->modifier_mask, keyboard->modifier_latched);
+    if (kbstate_to_kbtype(key->modifier) != KBT_DEFAULT) {
+        keyboard_set_layout(keyboard);
     }
+    if (keyboard->direct) {
+        // modifiers are applied to input sequences
+        return TRUE;
+    }
+    return send_key_event(key, event_type, key_state, KBT_DEFAULT);
+}
+
+/**
+ * Calculate keyboard geometry for given window width and screen
+ * @param keyboard Keyboard structure
+ * @param geometry Geometry structure with window width, screen height and dpi set
+ */
+static void keyboard_geometry_compute(const Keyboard *keyboard, KBgeometry *geometry) {
+    const gboolean is_portrait = geometry->portrait;
     // count units per row
     guint units_row_max = 0;
-    Key **p = keyboard->keys;
+    Key *p = keyboard->keys;
     for (guint i = 0; i < keyboard->row_count; i++) {
         guint units = 0;
         for (guint j = 0; j < keyboard->key_per_row[i]; j++) {
-            Key *key = *p++;
+            Key *key = p++;
             if (key->extended && is_portrait) {
                 continue;
             }
@@ -212,10 +418,14 @@ gboolean keyboard_set_size(gpointer data) {
         units_row_max = MAX(units_row_max, units);
     }
     guint unit_hmin = keyboard->unit_height;
-    guint unit_wmax = (units_row_max) ? ((guint) window_width / units_row_max) : 0;
+    guint unit_wmax = (units_row_max) ? ((guint) geometry->window_width / units_row_max) : 0;
     guint unit_wmin = keyboard->unit_width;
     // add padding and border
-    GtkWidget *first = keyboard->keys[0]->button;
+    GtkWidget *first = keyboard->keys[0].button;
+    if (keyboard->canvas) {
+        unit_wmin += 2 * KB_CANVAS_PADDING;
+        unit_hmin += 2 * KB_CANVAS_PADDING;
+    } else {
 #if GTK_CHECK_VERSION(3,0,0)
     GtkStyleContext *style = gtk_widget_get_style_context(first);
     GtkBorder extra = {0, 0, 0, 0};
@@ -237,15 +447,46 @@ gboolean keyboard_set_size(gpointer data) {
         gtk_border_free(border);
     }
 #endif
-    guint unit_w = MAX(unit_wmax, unit_wmin);
-    D printf("wmin: %d, wmax: %d => %d\n", unit_wmin, unit_wmax, unit_w);
+    }
+    geometry->unit_width = MAX(unit_wmax, unit_wmin);
+    D printf("wmin: %d, wmax: %d => %d\n", unit_wmin, unit_wmax, geometry->unit_width);
+
+    // calculate keyboard widget height
+    guint unit_h = unit_hmin;
+    const guint unit_hpref = (guint) (KB_KEYHEIGHT_PREF * geometry->dpi);
+    const guint unit_hmax = (guint) geometry->screen_height / KB_HEIGHTMAX_FACTOR / keyboard->row_count;
+    if (unit_hmin > unit_hmax || unit_hpref > unit_hmax) {
+        unit_h = unit_hmax;
+    }
+    else if (unit_hpref >= unit_hmin) {
+        unit_h = unit_hpref;
+    }
+    D printf("hmin: %d, hmax: %d, pref: %d => %d\n", unit_hmin, unit_hmax, unit_hpref, unit_h);
+    geometry->height = (gint) (unit_h * keyboard->row_count);
+    geometry->valid = TRUE;
+}
+
+/**
+ * Apply keyboard geometry to keys and keyboard container in one batch
+ * @param keyboard Keyboard structure
+ * @param geometry Geometry structure
+ */
+static void keyboard_geometry_apply(Keyboard *keyboard, const KBgeometry *geometry) {
+    const gboolean is_portrait = geometry->portrait;
+    keyboard->portrait = is_portrait;
+    GdkWindow *window = gtk_widget_get_window(keyboard->container);
+    if (window) { gdk_window_freeze_updates(window); }
     for (guint i = 0; i < keyboard->key_count; i++) {
-        Key *key = keyboard->keys[i];
-        guint width = unit_w;
+        Key *key = &keyboard->keys[i];
+        guint width = geometry->unit_width;
         if (key->width) {
             width *= key->width;
             width /= KEY_UNIT;
         }
+        if (keyboard->canvas) {
+            key->pixel_width = (key->extended && is_portrait) ? 0 : width;
+            continue;
+        }
         if (key->extended && is_portrait) {
             if (gtk_widget_get_visible(key->button)) {
                 gtk_widget_hide(key->button);
@@ -262,198 +503,1596 @@ gboolean keyboard_set_size(gpointer data) {
             gtk_widget_set_size_request(key->button, (gint) width, -1);
         }
     }
-    gint kb_width = window_width;
-    
-    // calculate keyboard widget height
-    gdouble dpi = gdk_screen_get_resolution(screen);
-    D printf("window size: %ix%i\n", window_width, window_height);
-    D printf("screen size: %ix%i (%i dpi)\n", screen_width, screen_height, (gint) dpi);
-    if (dpi < 0) { dpi = 96; }
-    guint unit_h = unit_hmin;
-    const guint unit_hpref = (guint) (KB_KEYHEIGHT_PREF * dpi);
-    const guint unit_hmax = (guint) screen_height / KB_HEIGHTMAX_FACTOR / keyboard->row_count;
-    if (unit_hmin > unit_hmax || unit_hpref > unit_hmax) {
-        unit_h = unit_hmax;
-    }
-    else if (unit_hpref >= unit_hmin) {
-        unit_h = unit_hpref;
+    D printf("keyboard size: %ix%i\n", geometry->window_width, geometry->height);
+    gtk_widget_set_size_request(keyboard->container, -1, geometry->height);
+    if (keyboard->canvas) {
+        keyboard_canvas_layout(keyboard);
     }
-    D printf("hmin: %d, hmax: %d, pref: %d => %d\n", unit_hmin, unit_hmax, unit_hpref, unit_h);
-    gint kb_height = (gint) (unit_h * keyboard->row_count);
-    D printf("keyboard size: %ix%i\n", kb_width, kb_height);
-    gtk_widget_set_size_request(keyboard_box, -1, kb_height);
-    return FALSE;
+    if (window) { gdk_window_thaw_updates(window); }
+    keyboard->geometry_applied = *geometry;
 }
 
 /**
- * Key press event callback
- * @param key Event key structure
- * @return True on success, false otherwise
+ * Drop cached geometry, must be called whenever keyboard unit sizes change
+ * @param keyboard Keyboard structure
  */
-static gboolean keyboard_event_press(Key *key) {
-    Keyboard *keyboard = key->keyboard;
-    GtkWidget *button = key->button;
-    if (key->modifier) {
-        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(button)));
-    } else {
-        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), TRUE);
+void keyboard_geometry_invalidate(Keyboard *keyboard) {
+    keyboard->geometry[0].valid = FALSE;
+    keyboard->geometry[1].valid = FALSE;
+    keyboard->geometry_applied.valid = FALSE;
+}
+
+/**
+ * Calculate and set key button sizes.
+ * Geometry is cached for each orientation and only recalculated when window width, screen height or dpi changes.
+ * @param data Keyboard structure
+ * @return Always false to cancel timeout, as called with g_timeout_add();
+ */
+gboolean keyboard_set_size(gpointer data) {
+    Keyboard *keyboard = data;
+    if G_UNLIKELY(keyboard == NULL) {
+        return FALSE;
     }
-    KBtype kb_type = kbstate_to_kbtype(keyboard->modifier_mask);
-    if (modifier_only_caps(keyboard)) {
-        // only caps lock
-        if (!key->obey_caps) { kb_type = KBT_DEFAULT; }
+    keyboard = keyboard->root->active;
+    if G_UNLIKELY(keyboard->key_count == 0 || keyboard->row_count == 0) {
+        return FALSE;
     }
-    D printf("press: %s (%i)\n", gdk_keyval_name(key->keyval[kb_type]), key->keyval[kb_type]);
-    D printf("modifier: %u\n", key->modifier);
-    D printf("modifier_mask: %u\n", keyboard->modifier_mask);
-    guint keyval = key->keyval[kb_type];
-    if (!keyval) {
-        if (kb_type == KBT_DEFAULT || (keyval = key->keyval[KBT_DEFAULT]) == 0) {
-            D printf("Empty action\n");
-            return TRUE;
-        }
+    gint64 start = g_get_monotonic_time();
+    GdkScreen *screen = gdk_screen_get_default();
+    gint screen_height = gdk_screen_get_height(screen);
+    GtkWidget *window = gtk_widget_get_toplevel(keyboard->container);
+    GtkAllocation alloc;
+    gtk_widget_get_allocation(window, &alloc);
+    gdouble dpi = gdk_screen_get_resolution(screen);
+    D printf("window size: %ix%i\n", alloc.width, alloc.height);
+    D printf("screen size: %ix%i (%i dpi)\n", gdk_screen_get_width(screen), screen_height, (gint) dpi);
+    if (dpi < 0) { dpi = 96; }
+    const gboolean is_portrait = (alloc.width < screen_height);
+    KBgeometry *geometry = &keyboard->geometry[is_portrait];
+    gboolean cached = (geometry->valid && geometry->window_width == alloc.width
+                       && geometry->screen_height == screen_height && geometry->dpi == (gint) dpi);
+    if (!cached) {
+        geometry->window_width = alloc.width;
+        geometry->screen_height = screen_height;
+        geometry->dpi = (gint) dpi;
+        geometry->portrait = is_portrait;
+        keyboard_geometry_compute(keyboard, geometry);
     }
-    GdkEventType event_type = GDK_KEY_PRESS;
-    guint key_state = (keyboard->modifier_mask & KB_MODIFIERS_BASIC_MASK);
-    if (key->modifier) {
-        if (keyboard->modifier_mask & key->modifier) {
-            event_type = GDK_KEY_RELEASE;
-        }
-        keyboard->modifier_mask ^= key->modifier;
-        if (kbstate_to_kbtype(key->modifier) != KBT_DEFAULT) {
-            keyboard_set_layout(keyboard);
-        }
+    const KBgeometry *applied = &keyboard->geometry_applied;
+    if (applied->valid && applied->portrait == geometry->portrait && applied->unit_width == geometry->unit_width
+        && applied->height == geometry->height && applied->window_width == geometry->window_width) {
+        D printf("keyboard geometry unchanged\n");
+        return FALSE;
     }
+    keyboard_geometry_apply(keyboard, geometry);
+    D printf("keyboard geometry %s applied in %" G_GINT64_FORMAT " us\n",
+             cached ? "(cached)" : "(computed)", g_get_monotonic_time() - start);
+    return FALSE;
+}
 
-    return send_key_event(key, event_type, key_state, keyval);
+/**
+ * Size timer callback
+ * @param data Keyboard structure
+ * @return Always false to cancel timeout, as called with g_timeout_add();
+ */
+static gboolean keyboard_size_timeout(gpointer data) {
+    Keyboard *keyboard = data;
+    keyboard->size_source = 0;
+    return keyboard_set_size(keyboard);
 }
 
 /**
- * Key release event callback
- * @param data Event key structure
- * @return Always false to cancel timout, as called by g_timeout_add()
+ * Schedule keyboard size update, repeated requests within KB_RESIZE_DEBOUNCE_MS are merged
+ * @param keyboard Keyboard structure
  */
-static gboolean keyboard_event_release(gpointer data) {
-    Key *key = data;
-    Keyboard *keyboard = key->keyboard;
-    GtkWidget *button = key->button;
-    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), FALSE);
-    KBtype kb_type = kbstate_to_kbtype(keyboard->modifier_mask);
-    if (modifier_only_caps(keyboard) && !key->obey_caps) {
-        kb_type = KBT_DEFAULT;
+void keyboard_queue_size(Keyboard *keyboard) {
+    if (keyboard == NULL) {
+        return;
     }
-    D printf("release: %s (%i)\n", gdk_keyval_name(key->keyval[kb_type]), key->keyval[kb_type]);
-    guint keyval = 0;
-    if ((keyval = key->keyval[kb_type]) == 0 && (keyval = key->keyval[KBT_DEFAULT]) == 0) {
-        D printf("Empty action\n");
-        return FALSE;
+    if (keyboard->size_source) {
+        g_source_remove(keyboard->size_source);
     }
-    
-    guint key_state = (keyboard->modifier_mask & KB_MODIFIERS_BASIC_MASK);
+    keyboard->size_source = g_timeout_add(KB_RESIZE_DEBOUNCE_MS, keyboard_size_timeout, keyboard);
+}
 
-    send_key_event(key, GDK_KEY_RELEASE, key_state, keyval);
-    if (keyboard->modifier_mask & KB_MODIFIERS_SET_MASK) {
-        keyboard_reset_modifiers(keyboard);
-        keyboard_set_layout(keyboard);
+/**
+ * Free hit-test index
+ * @param index Hit-test index
+ */
+static void keyboard_index_free(KBhitindex *index) {
+    if (index) {
+        g_free(index->cells);
+        g_free(index->nearest);
+        g_free(index);
     }
-    return FALSE;
 }
 
 /**
- * Key release event callback
- * @param button Key button widget
- * @param key Key structure
+ * Build hit-test index for current orientation from key areas.
+ * Index is kept for each orientation and only rebuilt when keyboard size or slop radius changes.
+ * @param keyboard Keyboard structure
  */
-static void keyboard_terminal_feed(GtkWidget *button, const Key *key) {
-    // send characters directly via vte_terminal_feed_child()
-    GtkWidget *toplevel = gtk_widget_get_toplevel(button);
-    GList *box_list = gtk_container_get_children(GTK_CONTAINER(toplevel));
-    GtkWidget *kterm_box = box_list->data;
-    g_list_free(box_list);
-    box_list = gtk_container_get_children(GTK_CONTAINER(kterm_box));
-    GtkWidget *terminal = NULL;
-    for (GList *cur = box_list; cur != NULL; cur = cur->next) {
-        const gchar *box_name = gtk_widget_get_name(GTK_WIDGET(cur->data));
-        if (!strcmp(box_name, "termBox")) { terminal = GTK_WIDGET(cur->data); }
-    }
-    g_list_free(box_list);
-    if G_UNLIKELY(!terminal) {
+void keyboard_index_build(Keyboard *keyboard) {
+    GtkAllocation alloc;
+    gtk_widget_get_allocation(keyboard->widget, &alloc);
+    if (alloc.width <= 1 || alloc.height <= 1 || keyboard->row_count == 0) {
         return;
     }
-
-    Keyboard *keyboard = key->keyboard;
-    KBtype kb_type = kbstate_to_kbtype(keyboard->modifier_mask);
-    if (modifier_only_caps(keyboard)) {
-        // only caps lock
-        if (!key->obey_caps) { kb_type = KBT_DEFAULT; }
+    guint32 hash = 0;
+    for (guint i = 0; i < keyboard->key_count; i++) {
+        const GdkRectangle *rect = &keyboard->keys[i].rect;
+        hash = hash * 31 + (guint32) (rect->x ^ (rect->width << 16));
+        hash = hash * 31 + (guint32) (rect->y ^ (rect->height << 16));
+    }
+    gdouble dpi = gdk_screen_get_resolution(gdk_screen_get_default());
+    if (dpi < 0) { dpi = 96; }
+    const gint slop = (gint) (conf->kb_slop * MM_TO_IN * dpi);
+    KBhitindex *index = keyboard->hit_index[keyboard->portrait];
+    if (index && index->width == alloc.width && index->height == alloc.height && index->hash == hash
+        && index->slop == slop) {
+        return;
     }
-    gchar utf[6];
-    gint utf_len = g_unichar_to_utf8(gdk_keyval_to_unicode(key->keyval[kb_type]), utf);
-    D printf("feed child: %i chars\n", utf_len);
-    vte_terminal_feed_child(VTE_TERMINAL(terminal), utf, utf_len);
+    keyboard_index_free(index);
+    gint64 start = g_get_monotonic_time();
+    index = g_malloc0(sizeof(KBhitindex));
+    index->width = alloc.width;
+    index->height = alloc.height;
+    index->hash = hash;
+    index->slop = slop;
+    index->columns = ((guint) alloc.width + KB_HIT_CELL - 1) / KB_HIT_CELL;
+    index->rows = ((guint) alloc.height + KB_HIT_CELL - 1) / KB_HIT_CELL;
+    index->cells = g_malloc0(index->rows * index->columns * sizeof(guint));
+    index->nearest = g_malloc0(index->rows * index->columns * sizeof(guint));
+    const gint64 slop_sq = (gint64) slop * slop;
+    for (guint r = 0; r < index->rows; r++) {
+        const gint y0 = (gint) r * KB_HIT_CELL;
+        const gint center_y = y0 + KB_HIT_CELL / 2;
+        guint *cells = &index->cells[r * index->columns];
+        guint *nearest = &index->nearest[r * index->columns];
+        for (guint c = 0; c < index->columns; c++) {
+            const gint x0 = (gint) c * KB_HIT_CELL;
+            const gint center_x = x0 + KB_HIT_CELL / 2;
+            gint64 best = slop_sq + 1;
+            for (guint k = 0; k < keyboard->key_count; k++) {
+                const Key *key = &keyboard->keys[k];
+                if (key->rect.width == 0) { continue; }
+                const gint left = key->rect.x;
+                const gint right = key->rect.x + key->rect.width;
+                const gint top = key->rect.y;
+                const gint bottom = key->rect.y + key->rect.height;
+                if (!cells[c] && right > x0 && left < x0 + KB_HIT_CELL && bottom > y0 && top < y0 + KB_HIT_CELL) {
+                    cells[c] = k + 1;
+                }
+                if (key->space) { continue; }
+                // distance from cell center to key area, keys in neighbouring rows are also reached
+                const gint dx = (center_x < left) ? left - center_x : (center_x >= right) ? center_x - right + 1 : 0;
+                const gint dy = (center_y < top) ? top - center_y : (center_y >= bottom) ? center_y - bottom + 1 : 0;
+                const gint64 distance = (gint64) dx * dx + (gint64) dy * dy;
+                if (distance < best) {
+                    best = distance;
+                    nearest[c] = k + 1;
+                }
+            }
+        }
+    }
+    keyboard->hit_index[keyboard->portrait] = index;
+    D printf("hit index %ix%i (%s, slop %i px) built in %" G_GINT64_FORMAT " us\n", index->width, index->height,
+             keyboard->portrait ? "portrait" : "landscape", slop, g_get_monotonic_time() - start);
 }
 
 /**
- * Key event callback
- * @param button Key button widget
- * @param ev Gdk event
- * @param key Key structure
- * @return True to stop processing event, false otherwise
+ * Find key at keyboard widget position, snap to nearest key within slop radius
+ * @param keyboard Keyboard structure
+ * @param x Horizontal position
+ * @param y Vertical position
+ * @return Key structure or null if none found
  */
-gboolean keyboard_event(GtkWidget *button, GdkEvent *ev, Key *key) {
-    if (ev->type == GDK_BUTTON_PRESS) {
-        if (!keyboard_event_press(key)) {
-            // not in keymap, try workaround
-            keyboard_terminal_feed(button, key);
+static Key * keyboard_key_at(Keyboard *keyboard, gint x, gint y) {
+    const KBhitindex *index = keyboard->hit_index[keyboard->portrait];
+    if (index == NULL || x < 0 || y < 0 || x >= index->width || y >= index->height) {
+        return NULL;
+    }
+    const guint cell = ((guint) y / KB_HIT_CELL) * index->columns + (guint) x / KB_HIT_CELL;
+    guint k = index->cells[cell];
+    if (k) {
+        // cell may contain boundaries between keys, keys are ordered by rows
+        for (guint i = k - 1; i < keyboard->key_count; i++) {
+            Key *key = &keyboard->keys[i];
+            if (key->rect.width && key->rect.y > y) { break; }
+            if (!key->space && key->rect.width && x >= key->rect.x && x < key->rect.x + key->rect.width
+                && y >= key->rect.y && y < key->rect.y + key->rect.height) {
+                return key;
+            }
         }
-        return TRUE;
-    } else if (ev->type == GDK_BUTTON_RELEASE && !key->modifier) {
-        g_timeout_add(KB_RELEASE_DELAY_MS, keyboard_event_release, key);
-        return TRUE;
     }
-    return FALSE;
+    if ((k = index->nearest[cell]) != 0) {
+        keyboard->hit_corrected++;
+        D printf("touch %i,%i corrected to nearest key (%u corrections)\n", x, y, keyboard->hit_corrected);
+        return &keyboard->keys[k - 1];
+    }
+    return NULL;
 }
 
 /**
- * Free key structure
- * @param key Key structure
+ * Apply modifiers to terminal input sequence (xterm conventions)
+ * @param sequence Unmodified sequence
+ * @param len Sequence length
+ * @param state Modifiers state
+ * @param buf Output buffer of KB_SEQUENCE_MAX size
+ * @return Length of modified sequence
  */
-void keyboard_key_free(Key *key) {
-    if (key) {
-        if (key->button && GTK_IS_WIDGET(key->button)) { gtk_widget_destroy(key->button); }
-        for (gint i = 0; i < KBT_COUNT; i++) {
-            if (key->image[i] && GTK_IS_WIDGET(key->image[i])) { gtk_widget_destroy(key->image[i]); }
-            if (key->label[i]) { g_free(key->label[i]); }
+static gsize keyboard_sequence_modify(const gchar *sequence, gsize len, guint state, gchar *buf) {
+    guint param = 1;
+    if (state & GDK_SHIFT_MASK) { param += 1; }
+    if (state & GDK_MOD1_MASK) { param += 2; }
+    if (state & GDK_CONTROL_MASK) { param += 4; }
+    if (param == 1 || len + 2 >= KB_SEQUENCE_MAX) {
+        memcpy(buf, sequence, len);
+        return len;
+    }
+    if (len > 2 && sequence[0] == '\033' && (sequence[1] == '[' || sequence[1] == 'O')) {
+        // CSI or SS3 sequence: add modifier parameter
+        gint ret;
+        if (sequence[len - 1] == '~') {
+            ret = g_snprintf(buf, KB_SEQUENCE_MAX, "%.*s;%u~", (gint) (len - 1), sequence, param);
+        } else {
+            ret = g_snprintf(buf, KB_SEQUENCE_MAX, "\033[1;%u%c", param, sequence[len - 1]);
+        }
+        return (gsize) MIN(ret, KB_SEQUENCE_MAX - 1);
+    }
+    if (len == 1 && sequence[0] == '\t' && (state & GDK_SHIFT_MASK)) {
+        memcpy(buf, "\033[Z", 3);
+        return 3;
+    }
+    gsize out = 0;
+    if (state & GDK_MOD1_MASK) {
+        // alt sends escape prefix
+        buf[out++] = '\033';
+    }
+    memcpy(buf + out, sequence, len);
+    if (len == 1 && (state & GDK_CONTROL_MASK)) {
+        gchar c = sequence[0];
+        if (c == ' ' || c == '@') {
+            c = 0;
+        } else if (c == '?') {
+            c = 0x7f;
+        } else if ((c >= 'a' && c <= 'z') || (c >= '@' && c <= '_')) {
+            c &= 0x1f;
         }
-        g_free(key);
-        key = NULL;
+        buf[out] = c;
     }
+    return out + len;
+}
+
+/**
+ * Check whether key variant has action
+ * @param key Key structure
+ * @param type Layout variant
+ * @return True if key has keyval or string action
+ */
+static inline gboolean keyboard_key_has_action(const Key *key, KBtype type) {
+    return (key->keyval[type] || key->sequence[type] || key->layout_id[type]);
 }
 
 /**
- * Recursively free array of key structures
- * @param keys Array of key structures
+ * Check whether key variant input is written directly to terminal.
+ * Cursor keys sequences depend on cursor keys mode (DECCKM), which is switched
+ * by applications (vim, less, readline), so in direct mode they are still sent
+ * as key events and terminal chooses the sequence.
+ * @param key Key structure
+ * @param type Layout variant
+ * @return True if input is written to terminal, false if it is sent as key event
  */
-static void keyboard_keys_free(Key **keys) {
-    if (keys == NULL) {
-        return;
+static gboolean keyboard_key_direct(const Key *key, KBtype type) {
+    if (key->action[type] == KBA_STRING) {
+        return TRUE;
     }
-    guint count = (*keys && (*keys)->keyboard) ? (*keys)->keyboard->key_count : 0;
-    for (guint i = 0; i < count; i++) {
-        if (keys[i] == NULL) { break; }
-        keyboard_key_free(keys[i]);
+    if (!key->keyboard->direct) {
+        return FALSE;
     }
-    g_free(keys);
+    const gchar *sequence = key->sequence[type];
+    const gboolean cursor = (sequence && key->sequence_len[type] == 3 && sequence[0] == '\033' && sequence[1] == '['
+                             && strchr("ABCDEFH", sequence[2]));
+    return !cursor;
 }
 
 /**
- * Recursively free keyboard structure
- * @param keyboard structure
+ * Write key input sequence directly to terminal with vte_terminal_feed_child()
+ * @param key Key structure
+ * @param type Layout variant
+ * @param state Modifiers state
+ * @param count Count of sequence repeats, written in one batch
+ * @return True on success, false otherwise
  */
-void keyboard_free(Keyboard **keyboard) {
-    if (keyboard && *keyboard) {
-        keyboard_keys_free((*keyboard)->keys);
-        (*keyboard)->keys = NULL;
+static gboolean keyboard_terminal_feed(const Key *key, KBtype type, guint state, guint count) {
+    const Keyboard *keyboard = key->keyboard;
+    if G_UNLIKELY(keyboard->terminal == NULL || key->sequence[type] == NULL) {
+        return FALSE;
+    }
+    count = CLAMP(count, 1, KB_REPEAT_BATCH_MAX);
+    if (key->action[type] == KBA_STRING) {
+        // sent verbatim
+        const gsize len = key->sequence_len[type];
+        if (count == 1) {
+            D printf("feed child: string %zu bytes\n", len);
+            vte_terminal_feed_child(keyboard->terminal, key->sequence[type], (glong) len);
+            return TRUE;
+        }
+        gchar *repeated = g_malloc(len * count);
+        for (guint i = 0; i < count; i++) {
+            memcpy(repeated + i * len, key->sequence[type], len);
+        }
+        D printf("feed child: string %zu bytes\n", len * count);
+        vte_terminal_feed_child(keyboard->terminal, repeated, (glong) (len * count));
+        g_free(repeated);
+        return TRUE;
+    }
+    gchar buf[KB_SEQUENCE_MAX * KB_REPEAT_BATCH_MAX];
+    gsize len = keyboard_sequence_modify(key->sequence[type], key->sequence_len[type], state, buf);
+    for (guint i = 1; i < count; i++) {
+        memcpy(buf + i * len, buf, len);
+    }
+    D printf("feed child: %zu bytes\n", len * count);
+    vte_terminal_feed_child(keyboard->terminal, buf, (glong) (len * count));
+    return TRUE;
+}
+
+/**
+ * Stop key repeat
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_repeat_stop(Keyboard *keyboard) {
+    if (keyboard->repeat_source) {
+        g_source_remove(keyboard->repeat_source);
+        keyboard->repeat_source = 0;
+    }
+    keyboard->repeat_key = NULL;
+}
+
+/**
+ * Key repeat timer callback, sends all repeats due since last call in one batch.
+ * Repeats take the same path as the press: sequences written to terminal are batched
+ * in one write, key events are sent as release and press pairs, like X autorepeat,
+ * so that terminal applies its keypad and cursor modes.
+ * @param data Keyboard structure
+ * @return Always false to cancel timout, as called by g_timeout_add()
+ */
+static gboolean keyboard_repeat_timeout(gpointer data) {
+    Keyboard *keyboard = data;
+    keyboard->repeat_source = 0;
+    Key *key = keyboard->repeat_key;
+    if (key == NULL) {
+        return FALSE;
+    }
+    gint64 now = g_get_monotonic_time();
+    guint count = 0;
+    while (keyboard->repeat_due <= now && count < KB_REPEAT_BATCH_MAX) {
+        count++;
+        keyboard->repeat_due += keyboard->repeat_interval;
+        // accelerate
+        keyboard->repeat_interval = MAX(keyboard->repeat_interval * (100 - conf->kb_repeat_accel) / 100,
+                                        KB_REPEAT_MIN_MS * 1000);
+    }
+    if (keyboard->repeat_due <= now) {
+        // drop repeats over batch limit
+        keyboard->repeat_due = now + keyboard->repeat_interval;
+    }
+    D printf("repeat: %u (interval %u ms)\n", count, keyboard->repeat_interval / 1000);
+    const KBtype type = keyboard->repeat_type;
+    const guint state = keyboard->repeat_state;
+    if (keyboard_key_direct(key, type) || !send_key_event(key, GDK_KEY_RELEASE, state, type)) {
+        keyboard_terminal_feed(key, type, state, count);
+    } else {
+        send_key_event(key, GDK_KEY_PRESS, state, type);
+        for (guint i = 1; i < count; i++) {
+            send_key_event(key, GDK_KEY_RELEASE, state, type);
+            send_key_event(key, GDK_KEY_PRESS, state, type);
+        }
+    }
+    guint delay = (guint) ((keyboard->repeat_due - now) / 1000);
+    keyboard->repeat_source = g_timeout_add(MAX(delay, KB_REPEAT_BATCH_MS), keyboard_repeat_timeout, keyboard);
+    return FALSE;
+}
+
+/**
+ * Start repeating held key
+ * @param key Key structure
+ * @param type Layout variant
+ * @param state Modifiers state
+ */
+static void keyboard_repeat_start(Key *key, KBtype type, guint state) {
+    Keyboard *keyboard = key->keyboard;
+    if (conf->kb_repeat_interval == 0) {
+        return;
+    }
+    keyboard->repeat_key = key;
+    keyboard->repeat_type = type;
+    keyboard->repeat_state = state;
+    keyboard->repeat_interval = conf->kb_repeat_interval * 1000;
+    keyboard->repeat_due = g_get_monotonic_time() + conf->kb_repeat_delay * 1000;
+    keyboard->repeat_source = g_timeout_add(conf->kb_repeat_delay, keyboard_repeat_timeout, keyboard);
+}
+
+/**
+ * Check whether key defers its action to release to recognize swipe or long press
+ * @param key Key structure
+ * @return True if key has swipe or alternates
+ */
+static inline gboolean keyboard_key_is_gesture(const Key *key) {
+    return !key->modifier && (key->swipe || key->alternates);
+}
+
+/**
+ * Reset one-shot modifiers after key was sent, latched modifiers stay,
+ * so layout is not changed after each key
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_modifiers_consume(Keyboard *keyboard) {
+    if (keyboard->modifier_mask & KB_MODIFIERS_SET_MASK & ~keyboard->modifier_latched) {
+        keyboard_reset_modifiers(keyboard, FALSE);
+        keyboard_set_layout(keyboard);
+    }
+}
+
+/**
+ * Press key held by touch. Layout variant and modifiers state are captured in touch,
+ * so release is sent with the same state, even if modifiers changed meanwhile.
+ * One-shot modifiers are consumed on press, they do not apply to keys pressed later
+ * by other touches before this one is released.
+ * @param touch Touch structure holding key
+ * @param swiped Send shifted variant, regardless of modifiers
+ * @return True on success, false otherwise
+ */
+static gboolean keyboard_event_press(KBtouch *touch, gboolean swiped) {
+    Key *key = touch->key;
+    Keyboard *keyboard = key->keyboard;
+    keyboard_key_set_active(key, TRUE);
+    KBtype kb_type = kbstate_to_kbtype(keyboard->modifier_mask);
+    if (modifier_only_caps(keyboard)) {
+        // only caps lock
+        if (!key->obey_caps) { kb_type = KBT_DEFAULT; }
+    }
+    if (swiped && keyboard_key_has_action(key, KBT_SHIFT)) {
+        kb_type = KBT_SHIFT;
+    }
+    D printf("press: %s (%i)\n", gdk_keyval_name(key->keyval[kb_type]), key->keyval[kb_type]);
+    D printf("modifier_mask: %u\n", keyboard->modifier_mask);
+    guint key_state = (keyboard->modifier_mask & KB_MODIFIERS_BASIC_MASK);
+    touch->state = key_state;
+    touch->type = kb_type;
+    if (!keyboard_key_has_action(key, kb_type)) {
+        if (kb_type == KBT_DEFAULT || !keyboard_key_has_action(key, KBT_DEFAULT)) {
+            D printf("Empty action\n");
+            return TRUE;
+        }
+        kb_type = KBT_DEFAULT;
+        touch->type = kb_type;
+    }
+    if (key->action[kb_type] == KBA_LAYOUT) {
+        keyboard_key_set_active(key, FALSE);
+        keyboard_switch_layout(keyboard, key->layout_id[kb_type]);
+        return TRUE;
+    }
+    keyboard_repeat_stop(keyboard);
+    if (key->repeat && !keyboard_key_is_gesture(key)) {
+        keyboard_repeat_start(key, kb_type, key_state);
+    }
+    gboolean sent;
+    if (keyboard_key_direct(key, kb_type)) {
+        sent = keyboard_terminal_feed(key, kb_type, key_state, 1);
+    } else if (!(sent = send_key_event(key, GDK_KEY_PRESS, key_state, kb_type))) {
+        // not in keymap, try workaround
+        sent = keyboard_terminal_feed(key, kb_type, key_state, 1);
+    }
+    keyboard_modifiers_consume(keyboard);
+    return sent;
+}
+
+/**
+ * Check whether key is held by any touch
+ * @param keyboard Keyboard structure
+ * @param key Key structure
+ * @return True if held
+ */
+static gboolean keyboard_key_held(const Keyboard *keyboard, const Key *key) {
+    for (guint i = 0; i < KB_TOUCH_MAX; i++) {
+        if (keyboard->touches[i].key == key) { return TRUE; }
+    }
+    return FALSE;
+}
+
+/**
+ * Release key with layout variant and modifiers state captured on press
+ * @param release Pending release structure
+ */
+static void keyboard_key_release(const KBrelease *release) {
+    Key *key = release->key;
+    Keyboard *keyboard = key->keyboard;
+    if (!keyboard_key_held(keyboard, key)) {
+        keyboard_key_set_active(key, FALSE);
+    }
+    D printf("release: %s (%i)\n", gdk_keyval_name(key->keyval[release->type]), key->keyval[release->type]);
+    if (!keyboard_key_direct(key, release->type)) {
+        send_key_event(key, GDK_KEY_RELEASE, release->state, release->type);
+    }
+}
+
+/**
+ * Remove oldest pending release from queue
+ * @param keyboard Keyboard structure
+ * @return Pending release, valid until next release is queued
+ */
+static const KBrelease * keyboard_release_pop(Keyboard *keyboard) {
+    const KBrelease *release = &keyboard->release_queue[keyboard->release_head];
+    keyboard->release_head = (keyboard->release_head + 1) % KB_RELEASE_QUEUE;
+    keyboard->release_count--;
+    return release;
+}
+
+static gboolean keyboard_release_timeout(gpointer data);
+
+/**
+ * Start release timer for oldest pending release, unless already running
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_release_schedule(Keyboard *keyboard) {
+    if (keyboard->release_source || keyboard->release_count == 0) {
+        return;
+    }
+    gint64 due = keyboard->release_queue[keyboard->release_head].due;
+    gint64 now = g_get_monotonic_time();
+    guint delay = (due > now) ? (guint) ((due - now + 999) / 1000) : 0;
+    keyboard->release_source = g_timeout_add(delay, keyboard_release_timeout, keyboard);
+    keyboard->release_timers++;
+}
+
+/**
+ * Release timer callback, sends all releases that are due
+ * @param data Keyboard structure
+ * @return Always false to cancel timout, as called by g_timeout_add()
+ */
+static gboolean keyboard_release_timeout(gpointer data) {
+    Keyboard *keyboard = data;
+    keyboard->release_source = 0;
+    gint64 due = g_get_monotonic_time() + KB_RELEASE_COALESCE_MS * 1000;
+    guint released = 0;
+    while (keyboard->release_count && keyboard->release_queue[keyboard->release_head].due <= due) {
+        keyboard_key_release(keyboard_release_pop(keyboard));
+        released++;
+    }
+    D printf("release timer: %u released, %u pending (%u timers for %u releases)\n",
+             released, keyboard->release_count, keyboard->release_timers, keyboard->release_total);
+    keyboard_release_schedule(keyboard);
+    return FALSE;
+}
+
+/**
+ * Queue release of key held by touch after KB_RELEASE_DELAY_MS
+ * @param touch Touch structure
+ */
+static void keyboard_release_queue(const KBtouch *touch) {
+    Keyboard *keyboard = touch->key->keyboard;
+    if G_UNLIKELY(keyboard->release_count == KB_RELEASE_QUEUE) {
+        // queue full, release oldest now
+        keyboard_key_release(keyboard_release_pop(keyboard));
+    }
+    guint tail = (keyboard->release_head + keyboard->release_count) % KB_RELEASE_QUEUE;
+    keyboard->release_queue[tail].key = touch->key;
+    keyboard->release_queue[tail].type = touch->type;
+    keyboard->release_queue[tail].state = touch->state;
+    keyboard->release_queue[tail].due = g_get_monotonic_time() + KB_RELEASE_DELAY_MS * 1000;
+    keyboard->release_count++;
+    keyboard->release_total++;
+    keyboard_release_schedule(keyboard);
+}
+
+/**
+ * Send all pending releases immediately
+ * @param keyboard Keyboard structure
+ */
+void keyboard_release_flush(Keyboard *keyboard) {
+    if (keyboard == NULL) {
+        return;
+    }
+    gint64 start = g_get_monotonic_time();
+    guint released = 0;
+    for (guint i = 0; i < keyboard->layout_count; i++) {
+        Keyboard *layout = keyboard->layouts[i];
+        if (layout->release_source) {
+            g_source_remove(layout->release_source);
+            layout->release_source = 0;
+        }
+        released += layout->release_count;
+        while (layout->release_count) {
+            keyboard_key_release(keyboard_release_pop(layout));
+        }
+    }
+    D printf("flushed %u pending releases in %" G_GINT64_FORMAT " us\n", released, g_get_monotonic_time() - start);
+}
+
+/**
+ * Destroy alternates popup
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_popup_hide(Keyboard *keyboard) {
+    if (keyboard->popup) {
+        gtk_widget_destroy(keyboard->popup);
+        keyboard->popup = NULL;
+    }
+    keyboard->popup_selected = NULL;
+}
+
+/**
+ * Find alternates popup button under touch.
+ * Touch may stay at height of pressed key, then only horizontal position is compared.
+ * @param keyboard Keyboard structure
+ * @param x Root x position of touch
+ * @param y Root y position of touch
+ * @return Button widget, null if touch is outside popup
+ */
+static GtkWidget * keyboard_popup_button_at(Keyboard *keyboard, gdouble x, gdouble y) {
+    GdkWindow *window = keyboard->popup ? gtk_widget_get_window(keyboard->popup) : NULL;
+    if (window == NULL) {
+        return NULL;
+    }
+    gint origin_x = 0;
+    gint origin_y = 0;
+    gdk_window_get_origin(window, &origin_x, &origin_y);
+    GtkWidget *found = NULL;
+    GList *buttons = gtk_container_get_children(GTK_CONTAINER(gtk_bin_get_child(GTK_BIN(keyboard->popup))));
+    for (GList *l = buttons; l && found == NULL; l = l->next) {
+        GtkAllocation alloc;
+        gtk_widget_get_allocation(l->data, &alloc);
+        // popup is one key high and placed right above pressed key
+        if (x >= origin_x + alloc.x && x < origin_x + alloc.x + alloc.width
+            && y >= origin_y + alloc.y && y < origin_y + alloc.y + 2 * alloc.height) {
+            found = l->data;
+        }
+    }
+    g_list_free(buttons);
+    return found;
+}
+
+/**
+ * Highlight alternates popup button under gesture touch
+ * @param keyboard Keyboard structure
+ * @param x Root x position of touch
+ * @param y Root y position of touch
+ */
+static void keyboard_popup_select(Keyboard *keyboard, gdouble x, gdouble y) {
+    GtkWidget *button = keyboard_popup_button_at(keyboard, x, y);
+    if (button == keyboard->popup_selected) {
+        return;
+    }
+    if (keyboard->popup_selected) {
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(keyboard->popup_selected), FALSE);
+    }
+    if (button) {
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(button), TRUE);
+    }
+    keyboard->popup_selected = button;
+}
+
+/**
+ * Write alternate character of popup button under touch to terminal and close popup
+ * @param keyboard Keyboard structure
+ * @param x Root x position of touch
+ * @param y Root y position of touch
+ */
+static void keyboard_popup_commit(Keyboard *keyboard, gdouble x, gdouble y) {
+    GtkWidget *button = keyboard_popup_button_at(keyboard, x, y);
+    const gchar *text = button ? gtk_button_get_label(GTK_BUTTON(button)) : NULL;
+    if (keyboard->terminal && text) {
+        gchar buf[KB_SEQUENCE_MAX];
+        gsize len = keyboard_sequence_modify(text, strlen(text), keyboard->modifier_mask & KB_MODIFIERS_BASIC_MASK, buf);
+        D printf("alternate: %s\n", text);
+        vte_terminal_feed_child(keyboard->terminal, buf, (glong) len);
+        keyboard_modifiers_consume(keyboard);
+    } else {
+        D printf("alternates popup dismissed\n");
+    }
+    keyboard_popup_hide(keyboard);
+}
+
+/**
+ * Show popup with key alternates above key, one button per character.
+ * Alternate is chosen by sliding the same touch over popup and releasing it.
+ * @param key Key structure
+ */
+static void keyboard_popup_show(Key *key) {
+    Keyboard *keyboard = key->keyboard;
+    GdkWindow *window = keyboard->widget ? gtk_widget_get_window(keyboard->widget) : NULL;
+    if (window == NULL || key->rect.width == 0) {
+        return;
+    }
+    gint x = 0;
+    gint y = 0;
+    gdk_window_get_origin(window, &x, &y);
+    if (!gtk_widget_get_has_window(keyboard->widget)) {
+        GtkAllocation alloc;
+        gtk_widget_get_allocation(keyboard->widget, &alloc);
+        x += alloc.x;
+        y += alloc.y;
+    }
+    GtkWidget *popup = gtk_window_new(GTK_WINDOW_POPUP);
+    gtk_widget_set_name(popup, "ktermKbPopup");
+#if GTK_CHECK_VERSION(3,0,0)
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_box_set_homogeneous(GTK_BOX(box), TRUE);
+#else
+    GtkWidget *box = gtk_hbox_new(TRUE, 0);
+#endif
+    gtk_container_add(GTK_CONTAINER(popup), box);
+    gint count = 0;
+    for (const gchar *p = key->alternates; *p; p = g_utf8_next_char(p)) {
+        gchar *text = g_strndup(p, (gsize) (g_utf8_next_char(p) - p));
+        GtkWidget *button = gtk_toggle_button_new_with_label(text);
+        g_free(text);
+        gtk_widget_set_can_focus(button, FALSE);
+        gtk_widget_set_size_request(button, key->rect.width, key->rect.height);
+        gtk_box_pack_start(GTK_BOX(box), button, TRUE, TRUE, 0);
+        count++;
+    }
+    // centered above key, kept on screen
+    const gint width = key->rect.width * count;
+    const gint screen_width = gdk_screen_get_width(gtk_widget_get_screen(keyboard->widget));
+    x = CLAMP(x + key->rect.x + (key->rect.width - width) / 2, 0, MAX(screen_width - width, 0));
+    y = MAX(y + key->rect.y - key->rect.height, 0);
+    gtk_window_move(GTK_WINDOW(popup), x, y);
+    gtk_widget_show_all(popup);
+    keyboard->popup = popup;
+    D printf("alternates popup: %i characters\n", count);
+}
+
+/**
+ * Long press timer callback, shows alternates of held key
+ * @param data Keyboard structure
+ * @return Always false to cancel timout, as called by g_timeout_add()
+ */
+static gboolean keyboard_long_press_timeout(gpointer data) {
+    Keyboard *keyboard = data;
+    keyboard->gesture_source = 0;
+    if (keyboard->gesture) {
+        keyboard_popup_show(keyboard->gesture->key);
+    }
+    return FALSE;
+}
+
+/**
+ * Stop waiting for release of gesture key
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_gesture_stop(Keyboard *keyboard) {
+    if (keyboard->gesture_source) {
+        g_source_remove(keyboard->gesture_source);
+        keyboard->gesture_source = 0;
+    }
+    keyboard->gesture = NULL;
+}
+
+/**
+ * Drop pending gesture and alternates popup, eg. when layout is switched
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_gesture_cancel(Keyboard *keyboard) {
+    keyboard_gesture_stop(keyboard);
+    keyboard_popup_hide(keyboard);
+}
+
+/**
+ * Press of key with swipe or alternates, action is deferred to release
+ * @param touch Touch structure holding key
+ */
+static void keyboard_gesture_start(KBtouch *touch) {
+    Keyboard *keyboard = touch->key->keyboard;
+    keyboard_repeat_stop(keyboard);
+    keyboard_key_set_active(touch->key, TRUE);
+    keyboard->gesture = touch;
+    if (touch->key->alternates) {
+        keyboard->gesture_source = g_timeout_add(KB_LONG_PRESS_MS, keyboard_long_press_timeout, keyboard);
+    }
+}
+
+/**
+ * Release of key with swipe or alternates, frees touch.
+ * After long press the alternate under touch is sent, or popup is dismissed if touch is outside it,
+ * otherwise key is sent, with shifted variant if touch moved up at least KB_SWIPE_MM.
+ * @param keyboard Keyboard structure
+ * @param x Root x position of touch
+ * @param y Root y position of touch
+ */
+static void keyboard_gesture_end(Keyboard *keyboard, gdouble x, gdouble y) {
+    KBtouch *touch = keyboard->gesture;
+    keyboard_gesture_stop(keyboard);
+    if (keyboard->popup) {
+        keyboard_key_set_active(touch->key, FALSE);
+        keyboard_popup_commit(keyboard, x, y);
+    } else {
+        gdouble dpi = gdk_screen_get_resolution(gdk_screen_get_default());
+        if (dpi <= 0) { dpi = 96; }
+        const gboolean swiped = touch->key->swipe && touch->y - y >= KB_SWIPE_MM * MM_TO_IN * dpi;
+        keyboard_event_press(touch, swiped);
+        keyboard_release_queue(touch);
+    }
+    touch->key = NULL;
+}
+
+/**
+ * Find touch by sequence
+ * @param keyboard Keyboard structure
+ * @param sequence Gdk touch sequence, null for pointer
+ * @return Touch structure, null if not found
+ */
+static KBtouch * keyboard_touch_find(Keyboard *keyboard, gpointer sequence) {
+    for (guint i = 0; i < KB_TOUCH_MAX; i++) {
+        if (keyboard->touches[i].key && keyboard->touches[i].sequence == sequence) {
+            return &keyboard->touches[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Touch or pointer press on key.
+ * Touches are handled in order of arrival: pending gesture key is sent as tap
+ * before key pressed by next touch.
+ * @param keyboard Keyboard structure
+ * @param sequence Gdk touch sequence, null for pointer
+ * @param key Pressed key
+ * @param y Root y position of touch
+ */
+static void keyboard_touch_begin(Keyboard *keyboard, gpointer sequence, Key *key, gdouble y) {
+    if (keyboard->gesture && keyboard->popup) {
+        // another touch dismisses popup, long pressed key is dropped
+        KBtouch *gesture = keyboard->gesture;
+        keyboard_key_set_active(gesture->key, FALSE);
+        keyboard_gesture_cancel(keyboard);
+        gesture->key = NULL;
+    } else if (keyboard->gesture) {
+        keyboard_gesture_end(keyboard, 0, keyboard->gesture->y);
+    }
+    keyboard_popup_hide(keyboard);
+    KBtouch *held = keyboard_touch_find(keyboard, sequence);
+    if (held) {
+        // pointer pressed again while still holding key, eg. release was lost
+        if (keyboard->repeat_key == held->key) {
+            keyboard_repeat_stop(keyboard);
+        }
+        keyboard_release_queue(held);
+        held->key = NULL;
+    }
+    if (key->modifier) {
+        // modifiers toggle on press, release is ignored
+        keyboard_modifier_press(key);
+        return;
+    }
+    KBtouch *touch = NULL;
+    for (guint i = 0; touch == NULL && i < KB_TOUCH_MAX; i++) {
+        if (keyboard->touches[i].key == NULL) { touch = &keyboard->touches[i]; }
+    }
+    if G_UNLIKELY(touch == NULL) {
+        D printf("touch dropped, %u keys held\n", KB_TOUCH_MAX);
+        return;
+    }
+    touch->sequence = sequence;
+    touch->key = key;
+    touch->y = y;
+    if (keyboard_key_is_gesture(key)) {
+        keyboard_gesture_start(touch);
+        return;
+    }
+    keyboard_event_press(touch, FALSE);
+}
+
+/**
+ * Touch or pointer motion, highlights alternate under touch holding long pressed key
+ * @param keyboard Keyboard structure
+ * @param sequence Gdk touch sequence, null for pointer
+ * @param x Root x position of touch
+ * @param y Root y position of touch
+ * @return True if touch held key, false otherwise
+ */
+static gboolean keyboard_touch_motion(Keyboard *keyboard, gpointer sequence, gdouble x, gdouble y) {
+    KBtouch *touch = keyboard_touch_find(keyboard, sequence);
+    if (touch == NULL) {
+        return FALSE;
+    }
+    if (touch == keyboard->gesture && keyboard->popup) {
+        keyboard_popup_select(keyboard, x, y);
+    }
+    return TRUE;
+}
+
+/**
+ * Touch or pointer release, key is released with state captured on press
+ * @param keyboard Keyboard structure
+ * @param sequence Gdk touch sequence, null for pointer
+ * @param x Root x position of touch
+ * @param y Root y position of touch
+ * @return True if touch held key, false otherwise
+ */
+static gboolean keyboard_touch_end(Keyboard *keyboard, gpointer sequence, gdouble x, gdouble y) {
+    KBtouch *touch = keyboard_touch_find(keyboard, sequence);
+    if (touch == NULL) {
+        return FALSE;
+    }
+    if (touch == keyboard->gesture) {
+        keyboard_gesture_end(keyboard, x, y);
+        return TRUE;
+    }
+    if (keyboard->repeat_key == touch->key) {
+        keyboard_repeat_stop(keyboard);
+    }
+    keyboard_release_queue(touch);
+    touch->key = NULL;
+    return TRUE;
+}
+
+/**
+ * Check whether button event is emulated from touch, touches are tracked by their own events.
+ * Before GTK+ 3.22 emulation flag is not public, emulated event is recognized
+ * by timestamp of touch event it was generated from.
+ * @param keyboard Keyboard structure
+ * @param ev Gdk event
+ * @return True if emulated
+ */
+static inline gboolean keyboard_event_emulated(const Keyboard *keyboard, GdkEvent *ev) {
+#if GTK_CHECK_VERSION(3,22,0)
+    UNUSED(keyboard);
+    return gdk_event_get_pointer_emulated(ev);
+#elif GTK_CHECK_VERSION(3,4,0)
+    return keyboard->touch_time && ev->button.time == keyboard->touch_time;
+#else
+    UNUSED(keyboard);
+    UNUSED(ev);
+    return FALSE;
+#endif
+}
+
+/**
+ * Key event callback, handles button and (GTK+ 3) touch events
+ * @param button Key button widget
+ * @param ev Gdk event
+ * @param key Key structure
+ * @return True to stop processing event, false otherwise
+ */
+gboolean keyboard_event(GtkWidget *button, GdkEvent *ev, Key *key) {
+    UNUSED(button);
+    Keyboard *keyboard = key->keyboard;
+    switch (ev->type) {
+        case GDK_BUTTON_PRESS:
+            if (keyboard_event_emulated(keyboard, ev)) { return TRUE; }
+            keyboard_touch_begin(keyboard, NULL, key, ev->button.y_root);
+            return TRUE;
+        case GDK_BUTTON_RELEASE:
+            if (keyboard_event_emulated(keyboard, ev)) { return TRUE; }
+            keyboard_touch_end(keyboard, NULL, ev->button.x_root, ev->button.y_root);
+            return TRUE;
+        case GDK_MOTION_NOTIFY:
+            keyboard_touch_motion(keyboard, NULL, ev->motion.x_root, ev->motion.y_root);
+            return TRUE;
+#if GTK_CHECK_VERSION(3,4,0)
+        case GDK_TOUCH_BEGIN:
+            keyboard->touch_time = ev->touch.time;
+            keyboard_touch_begin(keyboard, ev->touch.sequence, key, ev->touch.y_root);
+            return TRUE;
+        case GDK_TOUCH_END:
+        case GDK_TOUCH_CANCEL:
+            keyboard->touch_time = ev->touch.time;
+            keyboard_touch_end(keyboard, ev->touch.sequence, ev->touch.x_root, ev->touch.y_root);
+            return TRUE;
+        case GDK_TOUCH_UPDATE:
+            keyboard_touch_motion(keyboard, ev->touch.sequence, ev->touch.x_root, ev->touch.y_root);
+            return TRUE;
+#endif
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * Load images of layout variant, done once when variant is first displayed
+ * @param key Key structure
+ * @param type Layout variant
+ */
+void keyboard_key_materialize(Key *key, KBtype type) {
+    if (key->materialized & (1U << type)) {
+        return;
+    }
+    key->materialized |= (1U << type);
+    if (key->image_path[type] == NULL) {
+        return;
+    }
+    if (key->pixbuf[type] == NULL) {
+        GError *error = NULL;
+        key->pixbuf[type] = keyboard_pixbuf_get(key->image_path[type], &error);
+        if G_UNLIKELY(error) {
+            D printf("Loading image failed: %s\n", error->message);
+            g_error_free(error);
+        }
+    }
+    if (key->button && key->pixbuf[type] && key->image[type] == NULL) {
+        key->image[type] = gtk_image_new_from_pixbuf(key->pixbuf[type]);
+    }
+    D printf("materialized variant %i: %s\n", type, key->image_path[type]);
+}
+
+/**
+ * Update keyboard minimum unit size with key contents size.
+ * Images are not decoded, only their size is read.
+ * @param key Key structure
+ * @param type Layout variant
+ * @param widget Widget used for label measurements
+ */
+void keyboard_key_measure(Key *key, KBtype type, GtkWidget *widget) {
+    Keyboard *keyboard = key->keyboard;
+    gint width = 0;
+    gint height = 0;
+    if (key->image_path[type]) {
+        if (key->width) {
+            // forced width
+        } else if (key->pixbuf[type]) {
+            width = gdk_pixbuf_get_width(key->pixbuf[type]);
+            height = gdk_pixbuf_get_height(key->pixbuf[type]);
+        } else if (gdk_pixbuf_get_file_info(key->image_path[type], &width, &height) == NULL) {
+            // only image header is read, decoding is deferred until variant is displayed
+            D printf("Reading image failed: %s\n", key->image_path[type]);
+        }
+    } else if (key->label[type] && !key->width && g_utf8_strlen(key->label[type], -1) == 1) {
+        PangoLayout *layout = gtk_widget_create_pango_layout(widget, key->label[type]);
+        pango_layout_get_pixel_size(layout, &width, &height);
+        g_object_unref(layout);
+    }
+    D printf("key width: %i\n", width);
+    if ((guint) width > keyboard->unit_width || (guint) height > keyboard->unit_height) {
+        keyboard->unit_width = MAX(keyboard->unit_width, (guint) width);
+        keyboard->unit_height = MAX(keyboard->unit_height, (guint) height);
+        keyboard_geometry_invalidate(keyboard);
+    }
+}
+
+/**
+ * Create key button widget
+ * @param key Key structure
+ */
+static void keyboard_key_build(Key *key) {
+    if (key->space) {
+        key->button = gtk_label_new(NULL);
+        gtk_widget_set_can_focus(key->button, FALSE);
+        return;
+    }
+    key->button = gtk_toggle_button_new();
+    gtk_widget_set_name(key->button, "ktermKbButton");
+    gtk_widget_set_can_focus(key->button, FALSE);
+    for (gint i = 0; i < KBT_COUNT && !key->keyboard->measured; i++) {
+        keyboard_key_measure(key, i, key->button);
+    }
+    keyboard_key_set_face(key, KBT_DEFAULT);
+    g_signal_connect(key->button, "button-press-event", G_CALLBACK(keyboard_event), key);
+    g_signal_connect(key->button, "button-release-event", G_CALLBACK(keyboard_event), key);
+    gtk_widget_add_events(key->button, GDK_BUTTON_MOTION_MASK);
+    g_signal_connect(key->button, "motion-notify-event", G_CALLBACK(keyboard_event), key);
+#if GTK_CHECK_VERSION(3,4,0)
+    gtk_widget_add_events(key->button, GDK_TOUCH_MASK);
+    g_signal_connect(key->button, "touch-event", G_CALLBACK(keyboard_event), key);
+#endif
+}
+
+/**
+ * Keyboard widget size allocation signal handler.
+ * Updates key areas from button allocations and hit-test index
+ * @param widget Keyboard widget
+ * @param alloc Size allocation
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_buttons_allocate_cb(GtkWidget *widget, GtkAllocation *alloc, Keyboard *keyboard) {
+    UNUSED(alloc);
+    for (guint i = 0; i < keyboard->key_count; i++) {
+        Key *key = &keyboard->keys[i];
+        if (!gtk_widget_get_visible(key->button) ||
+            !gtk_widget_translate_coordinates(key->button, widget, 0, 0, &key->rect.x, &key->rect.y)) {
+            key->rect.width = 0;
+            continue;
+        }
+        GtkAllocation button_alloc;
+        gtk_widget_get_allocation(key->button, &button_alloc);
+        key->rect.width = button_alloc.width;
+        key->rect.height = button_alloc.height;
+    }
+    keyboard_index_build(keyboard);
+}
+
+/**
+ * Create box for row of key buttons
+ * @return Row box widget
+ */
+static GtkWidget * keyboard_row_new(void) {
+#if GTK_CHECK_VERSION(3,0,0)
+    return gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+#else
+    return gtk_hbox_new(FALSE, 0);
+#endif
+}
+
+/**
+ * Build rows of key buttons.
+ * Rows are placed in event box, which receives touches between buttons.
+ * @param keyboard Keyboard structure
+ */
+static void keyboard_buttons_build(Keyboard *keyboard) {
+#if GTK_CHECK_VERSION(3,0,0)
+    GtkWidget *rows = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_box_set_homogeneous(GTK_BOX(rows), TRUE);
+#else
+    GtkWidget *rows = gtk_vbox_new(TRUE, 0);
+#endif
+    keyboard->widget = gtk_event_box_new();
+    gtk_event_box_set_visible_window(GTK_EVENT_BOX(keyboard->widget), FALSE);
+    gtk_widget_add_events(keyboard->widget, GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK | GDK_BUTTON_MOTION_MASK);
+    gtk_container_add(GTK_CONTAINER(keyboard->widget), rows);
+    // atlas gives key images and unit size without decoding or measuring
+    guint8 atlas_hash[KB_ATLAS_HASH_LEN];
+    gchar *atlas_path = keyboard_atlas_path(keyboard, keyboard->widget, atlas_hash);
+    const gboolean atlas_loaded = keyboard_atlas_load(keyboard, atlas_path, atlas_hash);
+    Key *p = keyboard->keys;
+    for (guint i = 0; i < keyboard->row_count; i++) {
+        GtkWidget *row = keyboard_row_new();
+        for (guint j = 0; j < keyboard->key_per_row[i]; j++) {
+            Key *key = p++;
+            keyboard_key_build(key);
+            gtk_box_pack_start(GTK_BOX(row), key->button, FALSE, FALSE, 0);
+        }
+        gtk_box_pack_start(GTK_BOX(rows), row, TRUE, TRUE, 0);
+    }
+    if (!atlas_loaded) {
+        keyboard_atlas_save(keyboard, atlas_path, atlas_hash);
+    }
+    g_free(atlas_path);
+    g_signal_connect(keyboard->widget, "button-press-event", G_CALLBACK(keyboard_area_event), keyboard);
+    g_signal_connect(keyboard->widget, "button-release-event", G_CALLBACK(keyboard_area_event), keyboard);
+    g_signal_connect(keyboard->widget, "motion-notify-event", G_CALLBACK(keyboard_area_event), keyboard);
+#if GTK_CHECK_VERSION(3,4,0)
+    gtk_widget_add_events(keyboard->widget, GDK_TOUCH_MASK);
+    g_signal_connect(keyboard->widget, "touch-event", G_CALLBACK(keyboard_area_event), keyboard);
+#endif
+    g_signal_connect_after(keyboard->widget, "size-allocate", G_CALLBACK(keyboard_buttons_allocate_cb), keyboard);
+}
+
+/**
+ * Build keyboard widgets for parsed layout
+ * @param keyboard Keyboard structure
+ * @param parent Parent widget for keyboard widget
+ */
+void keyboard_build(Keyboard *keyboard, GtkWidget *parent) {
+    keyboard->container = parent;
+    keyboard->canvas = conf->kb_canvas;
+    if (keyboard->canvas) {
+        keyboard_canvas_build(keyboard);
+    } else {
+        keyboard_buttons_build(keyboard);
+    }
+    gtk_box_pack_start(GTK_BOX(parent), keyboard->widget, TRUE, TRUE, 0);
+    keyboard_keymap_resolve(keyboard);
+    keyboard->keymap_handler = g_signal_connect(gdk_keymap_get_default(), "keys-changed",
+                                                G_CALLBACK(keyboard_keymap_changed_cb), keyboard);
+}
+
+/**
+ * Set terminal receiving keyboard input
+ * @param keyboard Keyboard structure
+ * @param terminal Terminal widget
+ */
+void keyboard_set_terminal(Keyboard *keyboard, GtkWidget *terminal) {
+    if (keyboard == NULL) {
+        return;
+    }
+    for (guint i = 0; i < keyboard->layout_count; i++) {
+        Keyboard *layout = keyboard->layouts[i];
+        layout->terminal = terminal ? VTE_TERMINAL(terminal) : NULL;
+        layout->direct = conf->kb_direct && terminal;
+    }
+    D printf("keyboard direct input: %i\n", keyboard->direct);
+}
+
+/**
+ * Switch displayed layout. Layout widgets are built on first use and kept,
+ * so later switches only swap widgets in keyboard container.
+ * @param keyboard Keyboard structure of any layout
+ * @param id Layout id
+ */
+void keyboard_switch_layout(Keyboard *keyboard, const gchar *id) {
+    Keyboard *root = keyboard->root;
+    Keyboard *target = NULL;
+    for (guint i = 0; i < root->layout_count; i++) {
+        if (root->layouts[i]->id && !strcmp(root->layouts[i]->id, id)) {
+            target = root->layouts[i];
+            break;
+        }
+    }
+    if (target == NULL || target == root->active) {
+        D printf("switch layout: %s not found or active\n", id);
+        return;
+    }
+    gint64 start = g_get_monotonic_time();
+    Keyboard *previous = root->active;
+    keyboard_repeat_stop(previous);
+    keyboard_gesture_cancel(previous);
+    if (previous->modifier_mask & KB_MODIFIERS_SET_MASK) {
+        keyboard_reset_modifiers(previous, TRUE);
+        keyboard_set_layout(previous);
+    }
+    GdkWindow *window = gtk_widget_get_window(root->container);
+    if (window) { gdk_window_freeze_updates(window); }
+    gboolean built = (target->widget != NULL);
+    if (!built) {
+        keyboard_build(target, root->container);
+        gtk_widget_show_all(target->widget);
+    } else {
+        gtk_widget_show(target->widget);
+    }
+    gtk_widget_hide(previous->widget);
+    root->active = target;
+    keyboard_set_size(root);
+    if (window) { gdk_window_thaw_updates(window); }
+    D printf("switch layout: %s -> %s (%s) in %" G_GINT64_FORMAT " us\n", previous->id, target->id,
+             built ? "cached" : "built", g_get_monotonic_time() - start);
+}
+
+/**
+ * Place buttons of reloaded row keys, reusing buttons of old keys at the same position
+ * @param row Row box widget
+ * @param keys Reloaded keys of the row
+ * @param count Reloaded keys count
+ * @param old Old keys of the row, buttons taken over are cleared
+ * @param old_count Old keys count
+ * @return Count of reused buttons
+ */
+static guint keyboard_row_reload(GtkWidget *row, Key *keys, guint count, Key *old, guint old_count) {
+    guint reused = 0;
+    for (guint j = 0; j < count; j++) {
+        Key *key = &keys[j];
+        Key *prev = (j < old_count) ? &old[j] : NULL;
+        if (prev && prev->button && prev->space == key->space) {
+            key->button = prev->button;
+            prev->button = NULL;
+            gtk_widget_set_size_request(key->button, -1, -1);
+            gtk_box_set_child_packing(GTK_BOX(row), key->button, FALSE, FALSE, 0, GTK_PACK_START);
+            if (!key->space) {
+                g_signal_handlers_disconnect_by_func(key->button, G_CALLBACK(keyboard_event), prev);
+                gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(key->button), FALSE);
+                gtk_button_set_image(GTK_BUTTON(key->button), NULL);
+                gtk_button_set_label(GTK_BUTTON(key->button), NULL);
+                for (gint i = 0; i < KBT_COUNT && !key->keyboard->measured; i++) {
+                    keyboard_key_measure(key, i, key->button);
+                }
+                keyboard_key_set_face(key, KBT_DEFAULT);
+                g_signal_connect(key->button, "button-press-event", G_CALLBACK(keyboard_event), key);
+                g_signal_connect(key->button, "button-release-event", G_CALLBACK(keyboard_event), key);
+                g_signal_connect(key->button, "motion-notify-event", G_CALLBACK(keyboard_event), key);
+#if GTK_CHECK_VERSION(3,4,0)
+                g_signal_connect(key->button, "touch-event", G_CALLBACK(keyboard_event), key);
+#endif
+            }
+            reused++;
+        } else {
+            keyboard_key_build(key);
+            gtk_box_pack_start(GTK_BOX(row), key->button, FALSE, FALSE, 0);
+        }
+        // buttons before position j are already in place, old buttons left after them are destroyed later
+        gtk_box_reorder_child(GTK_BOX(row), key->button, (gint) j);
+        gtk_widget_show(key->button);
+    }
+    return reused;
+}
+
+/**
+ * Place buttons of reloaded keys in existing rows, adding rows if needed
+ * @param keyboard Keyboard structure with reloaded keys
+ * @param old_keys Old keys
+ * @param old_key_per_row Old keys count in each row
+ * @param old_row_count Old rows count
+ * @return Count of reused buttons
+ */
+static guint keyboard_buttons_reload(Keyboard *keyboard, Key *old_keys, const guint *old_key_per_row, guint old_row_count) {
+    GtkWidget *rows = gtk_bin_get_child(GTK_BIN(keyboard->widget));
+    GList *children = gtk_container_get_children(GTK_CONTAINER(rows));
+    GList *child = children;
+    Key *p = keyboard->keys;
+    Key *old = old_keys;
+    guint reused = 0;
+    for (guint i = 0; i < keyboard->row_count; i++) {
+        GtkWidget *row = NULL;
+        guint old_count = 0;
+        if (child && i < old_row_count) {
+            row = child->data;
+            child = child->next;
+            old_count = old_key_per_row[i];
+        } else {
+            row = keyboard_row_new();
+            gtk_box_pack_start(GTK_BOX(rows), row, TRUE, TRUE, 0);
+            gtk_widget_show(row);
+        }
+        reused += keyboard_row_reload(row, p, keyboard->key_per_row[i], old, old_count);
+        p += keyboard->key_per_row[i];
+        old += old_count;
+    }
+    g_list_free(children);
+    return reused;
+}
+
+/**
+ * Destroy button rows left from old keys
+ * @param keyboard Keyboard structure with reloaded keys
+ */
+static void keyboard_rows_trim(Keyboard *keyboard) {
+    GtkWidget *rows = gtk_bin_get_child(GTK_BIN(keyboard->widget));
+    GList *children = gtk_container_get_children(GTK_CONTAINER(rows));
+    for (GList *row = g_list_nth(children, keyboard->row_count); row; row = row->next) {
+        gtk_widget_destroy(row->data);
+    }
+    g_list_free(children);
+}
+
+/**
+ * Take over keys of reparsed layout.
+ * Widgets of built layout are kept, only buttons that do not fit new keys are created or destroyed.
+ * @param layout Layout structure
+ * @param source Reparsed layout structure, left without keys
+ */
+static void keyboard_layout_reload(Keyboard *layout, Keyboard *source) {
+    gint64 start = g_get_monotonic_time();
+    Key *old_keys = layout->keys;
+    guint old_key_count = layout->key_count;
+    guint old_row_count = layout->row_count;
+    guint *old_key_per_row = layout->key_per_row;
+    GStringChunk *old_strings = layout->strings;
+    const gboolean built = (layout->widget != NULL);
+    if (built) {
+        keyboard_repeat_stop(layout);
+        keyboard_gesture_cancel(layout);
+        keyboard_reset_modifiers(layout, TRUE);
+    }
+    memset(layout->touches, 0, sizeof(layout->touches));
+    layout->keys = source->keys;
+    layout->key_per_row = source->key_per_row;
+    layout->key_count = source->key_count;
+    layout->row_count = source->row_count;
+    layout->strings = source->strings;
+    source->keys = NULL;
+    source->key_per_row = NULL;
+    source->key_count = 0;
+    source->row_count = 0;
+    source->strings = NULL;
+    for (guint i = 0; i < KB_STATES; i++) {
+        for (guint j = 0; j < KB_STATES; j++) {
+            g_free(layout->layout_diff[i][j]);
+            layout->layout_diff[i][j] = source->layout_diff[i][j];
+            layout->layout_diff_count[i][j] = source->layout_diff_count[i][j];
+            source->layout_diff[i][j] = NULL;
+        }
+    }
+    for (guint bit = 0; bit < KB_MODIFIER_BITS; bit++) {
+        g_free(layout->modifier_keys[bit]);
+        layout->modifier_keys[bit] = source->modifier_keys[bit];
+        layout->modifier_key_count[bit] = source->modifier_key_count[bit];
+        source->modifier_keys[bit] = NULL;
+    }
+    layout->modifier_tap = NULL;
+    for (guint i = 0; i < layout->key_count; i++) {
+        layout->keys[i].keyboard = layout;
+    }
+    layout->layout_state = KBT_DEFAULT;
+    keyboard_geometry_invalidate(layout);
+    keyboard_index_free(layout->hit_index[0]);
+    keyboard_index_free(layout->hit_index[1]);
+    layout->hit_index[0] = NULL;
+    layout->hit_index[1] = NULL;
+    layout->unit_width = 0;
+    layout->unit_height = 0;
+    layout->measured = FALSE;
+    guint reused = 0;
+    if (built && layout->canvas) {
+        keyboard_canvas_prepare(layout);
+    } else if (built) {
+        reused = keyboard_buttons_reload(layout, old_keys, old_key_per_row, old_row_count);
+    }
+    // old keys are freed after new keys load their images, so that unchanged images are taken from cache
+    for (guint i = 0; i < old_key_count; i++) {
+        keyboard_key_free(&old_keys[i]);
+    }
+    g_free(old_keys);
+    if (old_strings) { g_string_chunk_free(old_strings); }
+    if (built) {
+        if (!layout->canvas) { keyboard_rows_trim(layout); }
+        // caps lock survives reload
+        if (layout->modifier_mask & GDK_LOCK_MASK) {
+            keyboard_modifier_set_active(layout, GDK_LOCK_MASK, TRUE);
+        }
+        keyboard_keymap_resolve(layout);
+        keyboard_set_layout(layout);
+    }
+    D printf("layout %s reloaded: %u keys, %u buttons reused in %" G_GINT64_FORMAT " us\n",
+             layout->id ? layout->id : "(first)", layout->key_count, reused, g_get_monotonic_time() - start);
+}
+
+/**
+ * Apply reparsed layouts to running keyboard.
+ * Layouts are matched by id, first layout always replaces first layout.
+ * Matched layouts keep their widgets, new layouts are built on first use,
+ * removed layouts are destroyed.
+ * @param keyboard First layout structure
+ * @param parsed Reparsed first layout structure, freed by this function
+ */
+void keyboard_reload(Keyboard *keyboard, Keyboard *parsed) {
+    gint64 start = g_get_monotonic_time();
+    keyboard_release_flush(keyboard);
+    GdkWindow *window = keyboard->container ? gtk_widget_get_window(keyboard->container) : NULL;
+    if (window) { gdk_window_freeze_updates(window); }
+    Keyboard **layouts = g_new0(Keyboard *, parsed->layout_count);
+    for (guint i = 0; i < parsed->layout_count; i++) {
+        Keyboard *source = parsed->layouts[i];
+        Keyboard *layout = NULL;
+        if (i == 0) {
+            layout = keyboard;
+        } else if (source->id) {
+            for (guint j = 1; j < keyboard->layout_count && layout == NULL; j++) {
+                if (keyboard->layouts[j] && !g_strcmp0(keyboard->layouts[j]->id, source->id)) {
+                    layout = keyboard->layouts[j];
+                    // matched layouts are cleared, those left are removed
+                    keyboard->layouts[j] = NULL;
+                }
+            }
+        }
+        if (layout == NULL) {
+            // new layout, built on first switch
+            layout = source;
+            parsed->layouts[i] = NULL;
+            layout->root = keyboard;
+            layout->terminal = keyboard->terminal;
+            layout->direct = keyboard->direct;
+        } else {
+            keyboard_layout_reload(layout, source);
+            g_free(layout->id);
+            layout->id = source->id;
+            source->id = NULL;
+        }
+        layouts[i] = layout;
+    }
+    for (guint j = 1; j < keyboard->layout_count; j++) {
+        Keyboard *removed = keyboard->layouts[j];
+        if (removed == NULL) { continue; }
+        if (keyboard->active == removed) {
+            gtk_widget_show(keyboard->widget);
+            keyboard->active = keyboard;
+        }
+        GtkWidget *widget = removed->widget;
+        if (widget) { g_signal_handlers_disconnect_matched(widget, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, removed); }
+        D printf("layout %s removed\n", removed->id);
+        keyboard_free(&removed);
+        if (widget) { gtk_widget_destroy(widget); }
+    }
+    g_free(keyboard->layouts);
+    keyboard->layouts = layouts;
+    keyboard->layout_count = parsed->layout_count;
+    // reparsed layouts are left without keys or taken over
+    keyboard_free(&parsed);
+    keyboard_set_size(keyboard);
+    if (window) { gdk_window_thaw_updates(window); }
+    D printf("keyboard reloaded: %u layouts in %" G_GINT64_FORMAT " us\n",
+             keyboard->layout_count, g_get_monotonic_time() - start);
+}
+
+/**
+ * Keyboard widget button event handler, dispatches touches outside of key buttons
+ * @param widget Keyboard widget
+ * @param ev Gdk event
+ * @param keyboard Keyboard structure
+ * @return True to stop processing event, false otherwise
+ */
+gboolean keyboard_area_event(GtkWidget *widget, GdkEvent *ev, Keyboard *keyboard) {
+    UNUSED(widget);
+    Key *key = NULL;
+    switch (ev->type) {
+        case GDK_BUTTON_PRESS:
+            if (keyboard_event_emulated(keyboard, ev)) { return TRUE; }
+            key = keyboard_key_at(keyboard, (gint) ev->button.x, (gint) ev->button.y);
+            if (key == NULL) { return FALSE; }
+            keyboard_touch_begin(keyboard, NULL, key, ev->button.y_root);
+            return TRUE;
+        case GDK_BUTTON_RELEASE:
+            if (keyboard_event_emulated(keyboard, ev)) { return TRUE; }
+            return keyboard_touch_end(keyboard, NULL, ev->button.x_root, ev->button.y_root);
+        case GDK_MOTION_NOTIFY:
+            return keyboard_touch_motion(keyboard, NULL, ev->motion.x_root, ev->motion.y_root);
+#if GTK_CHECK_VERSION(3,4,0)
+        case GDK_TOUCH_BEGIN:
+            keyboard->touch_time = ev->touch.time;
+            key = keyboard_key_at(keyboard, (gint) ev->touch.x, (gint) ev->touch.y);
+            if (key == NULL) { return FALSE; }
+            keyboard_touch_begin(keyboard, ev->touch.sequence, key, ev->touch.y_root);
+            return TRUE;
+        case GDK_TOUCH_END:
+        case GDK_TOUCH_CANCEL:
+            keyboard->touch_time = ev->touch.time;
+            return keyboard_touch_end(keyboard, ev->touch.sequence, ev->touch.x_root, ev->touch.y_root);
+        case GDK_TOUCH_UPDATE:
+            return keyboard_touch_motion(keyboard, ev->touch.sequence, ev->touch.x_root, ev->touch.y_root);
+#endif
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * Free key resources, key memory is owned by keyboard
+ * @param key Key structure
+ */
+void keyboard_key_free(Key *key) {
+    if (key) {
+        if (key->button && GTK_IS_WIDGET(key->button)) { gtk_widget_destroy(key->button); }
+        for (gint i = 0; i < KBT_COUNT; i++) {
+            if (key->image[i] && GTK_IS_WIDGET(key->image[i])) { gtk_widget_destroy(key->image[i]); }
+            if (key->pixbuf[i]) { g_object_unref(key->pixbuf[i]); }
+        }
+    }
+}
+
+/**
+ * Allocate keys and rows arrays of keyboard in single block
+ * @param keyboard Keyboard structure
+ * @param key_count Keys count
+ * @param row_count Rows count
+ */
+void keyboard_keys_alloc(Keyboard *keyboard, guint key_count, guint row_count) {
+    const gsize keys_size = key_count * sizeof(Key);
+    gchar *block = g_malloc0(keys_size + row_count * sizeof(guint));
+    keyboard->keys = (Key *) block;
+    keyboard->key_per_row = (guint *) (block + keys_size);
+    keyboard->key_count = key_count;
+    keyboard->row_count = row_count;
+}
+
+/**
+ * Recursively free keyboard structure
+ * @param keyboard structure
+ */
+void keyboard_free(Keyboard **keyboard) {
+    if (keyboard && *keyboard) {
+        // stop reload first, parser thread may still be running
+        layout_reload_free((*keyboard)->reload);
+        if ((*keyboard)->release_source) { g_source_remove((*keyboard)->release_source); }
+        if ((*keyboard)->repeat_source) { g_source_remove((*keyboard)->repeat_source); }
+        if ((*keyboard)->size_source) { g_source_remove((*keyboard)->size_source); }
+        keyboard_gesture_cancel(*keyboard);
+        for (guint i = 0; i < (*keyboard)->key_count; i++) {
+            keyboard_key_free(&(*keyboard)->keys[i]);
+        }
+        // rows are in the same block
+        g_free((*keyboard)->keys);
+        if ((*keyboard)->strings) { g_string_chunk_free((*keyboard)->strings); }
+        for (guint i = 0; i < KB_STATES; i++) {
+            for (guint j = 0; j < KB_STATES; j++) {
+                g_free((*keyboard)->layout_diff[i][j]);
+            }
+        }
+        for (guint bit = 0; bit < KB_MODIFIER_BITS; bit++) {
+            g_free((*keyboard)->modifier_keys[bit]);
+        }
+        if ((*keyboard)->pango_layout) { g_object_unref((*keyboard)->pango_layout); }
+        keyboard_index_free((*keyboard)->hit_index[0]);
+        keyboard_index_free((*keyboard)->hit_index[1]);
+        if ((*keyboard)->keymap_handler) {
+            g_signal_handler_disconnect(gdk_keymap_get_default(), (*keyboard)->keymap_handler);
+        }
+        if ((*keyboard)->key_event) { gdk_event_free((*keyboard)->key_event); }
+        if ((*keyboard)->layouts) {
+            // first layout owns others
+            for (guint i = 0; i < (*keyboard)->layout_count; i++) {
+                if ((*keyboard)->layouts[i] != *keyboard) { keyboard_free(&(*keyboard)->layouts[i]); }
+            }
+            g_free((*keyboard)->layouts);
+        }
+        g_free((*keyboard)->id);
         g_free(*keyboard);
         *keyboard = NULL;
     }
@@ -24,6 +24,7 @@
 
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms.h>
+#include <vte/vte.h>
 /**
  * Keyboard layout variants
  */
@@ -37,70 +38,267 @@ typedef enum {
 } KBtype;
 
 /**
- * Lookup table name to keyval
+ * Key action kinds
  */
-struct kbsymlookup {
+typedef enum {
+    KBA_KEY = 0, /** Key value, sent as key event or its terminal sequence */
+    KBA_STRING, /** String written to terminal verbatim */
+    KBA_LAYOUT, /** Switch to other layout */
+    KBA_COUNT
+} KBaction;
+
+/** Count of keyboard display states: layout variants and caps lock only state */
+#define KB_STATES (KBT_COUNT + 1)
+/** Display state with only caps lock active (obey-caps keys shifted, others default) */
+#define KB_STATE_CAPS KBT_COUNT
+
+/**
+ * Lookup table keyval to terminal input sequence
+ */
+struct kbseqlookup {
     const guint keyval;
-    const gchar *name;
+    const gchar *sequence;
 };
 
 /**
- * Lookup table name to gdk modifier type
+ * Lookup table name to keyval and gdk modifier type (modifier names only)
  */
-struct kbmodlookup {
-    const GdkModifierType modifier;
-    const gchar *name;
-    const gchar *gdk_name;
+struct kbnamelookup {
+    const char *name;
+    guint keyval;
+    GdkModifierType modifier;
 };
 
+/** Gdk key symbol for both GTK+ 2 and 3 naming */
+#if GTK_CHECK_VERSION(3,0,0)
+#define KB_KEY(name) GDK_KEY_##name
+#else
+#define KB_KEY(name) GDK_##name
+#endif
+
 /** Mask of all kterm supported modifiers set */
 #define KB_MODIFIERS_SET_MASK (GDK_SHIFT_MASK | GDK_CONTROL_MASK | GDK_MOD1_MASK | GDK_MOD2_MASK | GDK_MOD3_MASK | GDK_MOD4_MASK)
 /** Mask of basic kterm supported modifiers set (shift, control, alt) */
 #define KB_MODIFIERS_BASIC_MASK (GDK_SHIFT_MASK | GDK_CONTROL_MASK | GDK_MOD1_MASK)
 
-/** Max count of key buttons */
-#define KEYS_MAX 500
-/** Max count of keyboard rows */
-#define ROWS_MAX 10
+/** Size of key strings chunk */
+#define KB_STRINGS_CHUNK 1024
+/** Max length of terminal input sequence with modifiers applied */
+#define KB_SEQUENCE_MAX 32
 /** Basic size of key button in internal units */
 #define KEY_UNIT 1000
+/** Side of square hit-test index cell in pixels */
+#define KB_HIT_CELL 8
+/** Max count of key repeats sent in one batch */
+#define KB_REPEAT_BATCH_MAX 16
+/** Max count of pending key releases */
+#define KB_RELEASE_QUEUE 64
+/** Count of gdk modifier bits indexed (shift to mod5) */
+#define KB_MODIFIER_BITS 8
+/** Length of key atlas digest (SHA1) */
+#define KB_ATLAS_HASH_LEN 20
+/** Max count of touches holding keys at the same time */
+#define KB_TOUCH_MAX 10
 
 struct Keyboard;
+/** Layout reload state */
+typedef struct KBreload KBreload;
+
+/**
+ * Keymap entry resolved for key value
+ */
+typedef struct {
+    guint16 keycode; /** Hardware keycode */
+    guint8 group; /** Keyboard group */
+    guint8 level; /** Shift level */
+    gboolean valid; /** Key value is present in keymap */
+} KBkeymap;
 
 /**
  * Single keyboard key structure
  */
 typedef struct Key {
-    GtkWidget *button; /** Button widget */
+    GtkWidget *button; /** Button widget, null on canvas keyboard */
     gchar *label[KBT_COUNT]; /** Labels array for each layout variant */
+    gchar *image_path[KBT_COUNT]; /** Image paths array for each layout variant */
+    GdkPixbuf *pixbuf[KBT_COUNT]; /** Image pixbufs array for each layout variant */
     GtkWidget *image[KBT_COUNT]; /** Image widgets array for each layout variant */
     guint keyval[KBT_COUNT]; /** Keyvals array for each layout variant */
+    KBkeymap keymap[KBT_COUNT]; /** Keymap entries array for each layout variant */
+    KBaction action[KBT_COUNT]; /** Action kinds array for each layout variant */
+    gchar *sequence[KBT_COUNT]; /** Terminal input sequences array for each layout variant */
+    gchar *layout_id[KBT_COUNT]; /** Layout ids to switch to for each layout variant */
+    guint sequence_len[KBT_COUNT]; /** Terminal input sequence lengths */
     GdkModifierType modifier; /** Modifier type for modifier button */
     guint width; /** Forced button width */
     gboolean obey_caps; /** Button should react to caps lock */
+    gboolean repeat; /** Key repeats while held */
+    gboolean lock; /** Modifier stays set until tapped again */
+    gboolean swipe; /** Swipe up sends shifted variant */
+    gchar *alternates; /** Characters offered in long press popup, null if none */
+    guint materialized; /** Bitmask of layout variants with images loaded */
     gboolean fill; /** Button may expand to fill free space */
     gboolean extended; /** Button only present in landscape view */
+    gboolean space; /** Empty spacer */
+    gboolean active; /** Key is pressed (canvas keyboard) */
+    guint pixel_width; /** Calculated width in pixels, zero if hidden (canvas keyboard) */
+    GdkRectangle rect; /** Key area in keyboard widget coordinates */
     struct Keyboard *keyboard; /** Pointer to keyboard structure */
 } Key;
 
+/**
+ * Touch hit-test index, maps keyboard widget position to key
+ */
+typedef struct {
+    gint width; /** Indexed area width */
+    gint height; /** Indexed area height */
+    guint32 hash; /** Hash of key areas used to build index */
+    gint slop; /** Slop radius in pixels used to build index */
+    guint columns; /** Cells count in a row */
+    guint rows; /** Cells count in a column */
+    guint *cells; /** First key overlapping each cell (key index + 1, zero if none) */
+    guint *nearest; /** Nearest key within slop radius from each cell center (key index + 1, zero if none) */
+} KBhitindex;
+
+/**
+ * Keyboard geometry for given window width and screen
+ */
+typedef struct {
+    gint window_width; /** Window width */
+    gint screen_height; /** Screen height */
+    gint dpi; /** Screen resolution */
+    gboolean portrait; /** Portrait orientation */
+    guint unit_width; /** Width of basic key in pixels */
+    gint height; /** Keyboard height */
+    gboolean valid; /** Geometry is calculated */
+} KBgeometry;
+
+/**
+ * Pending key release
+ */
+typedef struct {
+    Key *key; /** Released key */
+    KBtype type; /** Layout variant sent on press */
+    guint state; /** Modifiers state captured on press */
+    gint64 due; /** Monotonic time of release in us */
+} KBrelease;
+
+/**
+ * Touch point holding key, pointer is tracked as touch without sequence
+ */
+typedef struct {
+    gpointer sequence; /** Gdk touch sequence, null for pointer */
+    Key *key; /** Held key, null if slot is free */
+    KBtype type; /** Layout variant sent on press */
+    guint state; /** Modifiers state captured on press */
+    gdouble y; /** Root y position of press */
+} KBtouch;
+
 /**
  * Keyboard structure
  */
 typedef struct Keyboard {
-    Key **keys; /** Array of keys */
+    gchar *id; /** Layout id */
+    struct Keyboard *root; /** First parsed layout, owner of all layouts */
+    struct Keyboard **layouts; /** All parsed layouts (first layout only) */
+    guint layout_count; /** Layouts count (first layout only) */
+    struct Keyboard *active; /** Currently displayed layout (first layout only) */
+    Key *keys; /** Array of keys, one block with key_per_row array */
     guint32 modifier_mask; /** Current state of modifiers */
+    guint32 modifier_latched; /** Modifiers kept after next key (latched or locked) */
+    Key *modifier_tap; /** Last tapped modifier key */
+    gint64 modifier_tap_time; /** Monotonic time of last modifier tap in us */
+    Key **modifier_keys[KB_MODIFIER_BITS]; /** Modifier keys for each modifier bit */
+    guint modifier_key_count[KB_MODIFIER_BITS]; /** Modifier keys count for each modifier bit */
     guint key_count; /** Keys count */
     guint row_count; /** Rows count */
-    guint key_per_row[ROWS_MAX]; /** Keys count in each row */
+    guint *key_per_row; /** Keys count in each row, stored after keys array */
+    GStringChunk *strings; /** Interned key strings */
     guint unit_width; /** Precalculated minimum width of a button */
     guint unit_height; /** Precalculated minimum height of a button */
+    gboolean measured; /** Minimum button size is known, keys need not be measured */
     GtkWidget *container; /** Keyboard container */
+    GtkWidget *widget; /** Keyboard widget: box of button rows or canvas */
+    gboolean canvas; /** Keys are painted on single canvas widget */
+    KBtouch touches[KB_TOUCH_MAX]; /** Touches holding keys */
+    KBtouch *gesture; /** Touch on key with swipe or alternates waiting for release */
+    guint gesture_source; /** Long press timer source id, zero if none */
+    guint32 touch_time; /** Time of last touch event, pointer events emulated from touch share it */
+    GtkWidget *popup; /** Long press alternates popup window, null if hidden */
+    GtkWidget *popup_selected; /** Popup button under gesture touch, null if none */
+    gboolean portrait; /** Keyboard is in portrait orientation */
+    KBgeometry geometry[2]; /** Cached geometry for landscape and portrait orientation */
+    KBgeometry geometry_applied; /** Currently applied geometry */
+    guint size_source; /** Debounced size update source id, zero if none */
+    KBhitindex *hit_index[2]; /** Hit-test index for landscape and portrait orientation */
+    guint hit_corrected; /** Count of touches corrected to nearest key */
+    VteTerminal *terminal; /** Terminal receiving keyboard input */
+    gboolean direct; /** Input sequences are written directly to terminal */
+    GdkEvent *key_event; /** Key event template with device set, copied for each keystroke */
+    gboolean keymap_valid; /** Keymap entries and keyboard device are up to date */
+    gulong keymap_handler; /** Keymap keys-changed signal handler id */
+    Key *repeat_key; /** Key repeating while held */
+    KBtype repeat_type; /** Layout variant of repeating key */
+    guint repeat_state; /** Modifiers state of repeating key */
+    guint repeat_source; /** Repeat timer source id, zero if none */
+    gint64 repeat_due; /** Monotonic time of next repeat in us */
+    guint repeat_interval; /** Current repeat interval in us */
+    KBrelease release_queue[KB_RELEASE_QUEUE]; /** Ring buffer of pending key releases */
+    guint release_head; /** Index of oldest pending release */
+    guint release_count; /** Count of pending releases */
+    guint release_source; /** Release timer source id, zero if none */
+    guint release_total; /** Count of queued releases */
+    guint release_timers; /** Count of release timers started */
+    guint event_count; /** Count of sent key events */
+    gint64 event_time; /** Total time of sending key events in us */
+    PangoLayout *pango_layout; /** Layout reused for painting labels (canvas keyboard) */
+    guint layout_state; /** Currently displayed state */
+    Key **layout_diff[KB_STATES][KB_STATES]; /** Keys with different faces for each pair of states */
+    guint layout_diff_count[KB_STATES][KB_STATES]; /** Keys count in each diff */
+    KBreload *reload; /** Layout file watcher (first layout only) */
+    gboolean cache_stale; /** Loaded from cache with outdated file time or metrics, cache should be rewritten (first layout only) */
 } Keyboard;
 
 
 Keyboard * build_layout(GtkWidget *parent, GError **error);
+Keyboard * parse_layout(const gchar *path, const gchar *asset_suffix, GError **error);
+const gchar * layout_asset_suffix(gdouble dpi);
+void keyboard_build(Keyboard *keyboard, GtkWidget *parent);
+void keyboard_set_terminal(Keyboard *keyboard, GtkWidget *terminal);
+void keyboard_switch_layout(Keyboard *keyboard, const gchar *id);
+void keyboard_reload(Keyboard *keyboard, Keyboard *parsed);
 gboolean keyboard_event(GtkWidget *button, GdkEvent *ev, Key *key);
+gboolean keyboard_area_event(GtkWidget *widget, GdkEvent *ev, Keyboard *keyboard);
+void keyboard_index_build(Keyboard *keyboard);
 gboolean keyboard_set_size(gpointer data);
+void keyboard_geometry_invalidate(Keyboard *keyboard);
+void keyboard_queue_size(Keyboard *keyboard);
+KBtype keyboard_key_face(const Key *key, guint state);
+void keyboard_key_measure(Key *key, KBtype type, GtkWidget *widget);
+void keyboard_key_materialize(Key *key, KBtype type);
+void keyboard_canvas_build(Keyboard *keyboard);
+void keyboard_canvas_prepare(Keyboard *keyboard);
+GdkPixbuf * keyboard_pixbuf_get(const gchar *path, GError **error);
+void keyboard_pixbuf_forget(const gchar *path);
+void keyboard_canvas_layout(Keyboard *keyboard);
+void keyboard_canvas_queue_key(const Key *key);
+void keyboard_canvas_paint_label(Keyboard *keyboard, cairo_t *cr, const gchar *label,
+                                 gdouble x, gdouble y, gdouble width, gdouble height);
+gchar * keyboard_atlas_path(const Keyboard *keyboard, GtkWidget *widget, guint8 *hash);
+gboolean keyboard_atlas_load(Keyboard *keyboard, const gchar *path, const guint8 *hash);
+void keyboard_atlas_save(Keyboard *keyboard, const gchar *path, const guint8 *hash);
+void keyboard_release_flush(Keyboard *keyboard);
+void keyboard_keys_alloc(Keyboard *keyboard, guint key_count, guint row_count);
+Keyboard * layout_cache_load(const gchar *path, const gchar *suffix);
+Keyboard * layout_cache_load_data(const guint8 *data, gsize length, const gchar *path, const gchar *suffix);
+void layout_cache_save(const Keyboard *keyboard, const gchar *path, const gchar *suffix);
+gboolean layout_cache_write(const Keyboard *keyboard, const gchar *path, const gchar *suffix,
+                            const gchar *output, GError **error);
+gboolean layout_cache_write_c(const Keyboard *keyboard, const gchar *path, const gchar *suffix,
+                              const gchar *output, const gchar *name, GError **error);
+KBreload * layout_reload_watch(Keyboard *keyboard, const gchar *path, const gchar *asset_suffix);
+void layout_reload_free(KBreload *reload);
+const struct kbnamelookup * kbname_lookup(const char *str, size_t len);
 void keyboard_free(Keyboard **keyboard);
 void keyboard_key_free(Key *key);
 
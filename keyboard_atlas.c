@@ -0,0 +1,354 @@
+/* keyboard_atlas.c
+ *
+ * This file is part of kterm
+ *
+ * Copyright(C) 2016 Bartek Fabiszewski (www.fabiszewski.net)
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include "keyboard.h"
+#include "config.h"
+
+/** Global config */
+extern KTconf *conf;
+
+/** Atlas file magic */
+#define ATLAS_MAGIC 0x4b544131
+/** Atlas file format version, change invalidates cached files */
+#define ATLAS_VERSION 3
+/** Preferred atlas width in pixels */
+#define ATLAS_WIDTH 1024
+
+/**
+ * Atlas file header
+ */
+typedef struct {
+    guint32 magic; /** File magic */
+    guint32 version; /** Format version */
+    guint8 hash[KB_ATLAS_HASH_LEN]; /** Digest of keys, images, engine, fonts, resolution and theme */
+    guint32 key_count; /** Keys count in layout */
+    guint32 face_count; /** Faces count */
+    guint32 unit_width; /** Keyboard minimum unit width */
+    guint32 unit_height; /** Keyboard minimum unit height */
+    guint32 width; /** Atlas width */
+    guint32 height; /** Atlas height */
+    guint32 rowstride; /** Atlas rowstride */
+} AtlasHeader;
+
+/**
+ * Atlas face entry, area of key face in atlas
+ */
+typedef struct {
+    guint32 key; /** Key index */
+    guint32 type; /** Layout variant */
+    guint32 x; /** Face x position */
+    guint32 y; /** Face y position */
+    guint32 width; /** Face width */
+    guint32 height; /** Face height */
+} AtlasFace;
+
+/**
+ * Add file status to checksum, so that modified images invalidate atlas
+ * @param checksum Checksum
+ * @param path File path
+ */
+static void atlas_checksum_file(GChecksum *checksum, const gchar *path) {
+    GStatBuf st;
+    g_checksum_update(checksum, (const guchar *) path, -1);
+    if (g_stat(path, &st) == 0) {
+        gint64 stamp[2] = { (gint64) st.st_mtime, (gint64) st.st_size };
+        g_checksum_update(checksum, (const guchar *) stamp, sizeof(stamp));
+    }
+}
+
+/**
+ * Add string to checksum, including terminator, so that adjacent fields do not merge
+ * @param checksum Checksum
+ * @param str String, may be null
+ */
+static void atlas_checksum_string(GChecksum *checksum, const gchar *str) {
+    if (str) {
+        g_checksum_update(checksum, (const guchar *) str, (gssize) strlen(str) + 1);
+    } else {
+        g_checksum_update(checksum, (const guchar *) "", 1);
+    }
+}
+
+/**
+ * Get atlas cache path and digest of loaded layout keys, images, engine, fonts, screen resolution and theme.
+ * Digest is computed from parsed keys, so it works for embedded layout without layout file.
+ * Path depends only on layout path, id and engine, so that edited layout replaces its atlas
+ * instead of adding new file; digest stored in atlas header tells if it is current.
+ * @param keyboard Keyboard structure
+ * @param widget Widget used for label rendering
+ * @param hash Buffer of KB_ATLAS_HASH_LEN bytes for atlas digest
+ * @return Path, to be freed with g_free()
+ */
+gchar * keyboard_atlas_path(const Keyboard *keyboard, GtkWidget *widget, guint8 *hash) {
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    const guint32 version[] = { ATLAS_VERSION, GTK_MAJOR_VERSION, GTK_MINOR_VERSION,
+                                (guint32) keyboard->canvas, keyboard->key_count };
+    g_checksum_update(checksum, (const guchar *) version, sizeof(version));
+    atlas_checksum_string(checksum, keyboard->id);
+    for (guint i = 0; i < keyboard->key_count; i++) {
+        const Key *key = &keyboard->keys[i];
+        const guint32 flags[] = { key->width, (guint32) key->space };
+        g_checksum_update(checksum, (const guchar *) flags, sizeof(flags));
+        for (gint type = 0; type < KBT_COUNT; type++) {
+            atlas_checksum_string(checksum, key->label[type]);
+            if (key->image_path[type]) {
+                atlas_checksum_file(checksum, key->image_path[type]);
+            } else {
+                atlas_checksum_string(checksum, NULL);
+            }
+        }
+    }
+    PangoFontDescription *font = pango_context_get_font_description(gtk_widget_get_pango_context(widget));
+    gchar *font_name = pango_font_description_to_string(font);
+    g_checksum_update(checksum, (const guchar *) font_name, -1);
+    g_free(font_name);
+    gdouble dpi = gdk_screen_get_resolution(gdk_screen_get_default());
+    g_checksum_update(checksum, (const guchar *) &dpi, sizeof(dpi));
+    gchar *theme = NULL;
+    g_object_get(gtk_settings_get_default(), "gtk-theme-name", &theme, NULL);
+    if (theme) {
+        g_checksum_update(checksum, (const guchar *) theme, -1);
+        g_free(theme);
+    }
+    gsize hash_len = KB_ATLAS_HASH_LEN;
+    g_checksum_get_digest(checksum, hash, &hash_len);
+    g_checksum_free(checksum);
+    gchar *id = g_strdup_printf("%s|%s|%i", conf->kb_conf_path,
+                                keyboard->id ? keyboard->id : "", keyboard->canvas);
+    gchar *id_hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, id, -1);
+    gchar *name = g_strdup_printf("keyboard-%s.atlas", id_hash);
+    gchar *path = g_build_filename(g_get_user_cache_dir(), "kterm", name, NULL);
+    g_free(id);
+    g_free(id_hash);
+    g_free(name);
+    D printf("atlas path: %s\n", path);
+    return path;
+}
+
+/**
+ * Atlas pixbuf destroy notification, releases file mapping
+ * @param pixels Atlas pixels
+ * @param data Mapped file
+ */
+static void atlas_unmap_cb(guchar *pixels, gpointer data) {
+    UNUSED(pixels);
+    g_mapped_file_unref(data);
+}
+
+/**
+ * Load key faces from atlas file, mapped into memory.
+ * Key pixbufs share atlas pixels, no measuring or decoding is done.
+ * @param keyboard Keyboard structure
+ * @param path Atlas path
+ * @param hash Expected atlas digest
+ * @return True on success, false otherwise
+ */
+gboolean keyboard_atlas_load(Keyboard *keyboard, const gchar *path, const guint8 *hash) {
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+    if (mapped == NULL) {
+        D printf("atlas not found\n");
+        return FALSE;
+    }
+    const gchar *contents = g_mapped_file_get_contents(mapped);
+    gsize length = g_mapped_file_get_length(mapped);
+    AtlasHeader header;
+    if (length < sizeof(header)) {
+        g_mapped_file_unref(mapped);
+        return FALSE;
+    }
+    memcpy(&header, contents, sizeof(header));
+    const gsize faces_size = header.face_count * sizeof(AtlasFace);
+    if (header.magic != ATLAS_MAGIC || header.version != ATLAS_VERSION || memcmp(header.hash, hash, KB_ATLAS_HASH_LEN)
+        || header.key_count != keyboard->key_count
+        || header.width == 0 || header.height == 0 || header.rowstride < header.width * 4
+        || length != sizeof(header) + faces_size + (gsize) header.rowstride * header.height) {
+        D printf("atlas invalid\n");
+        g_mapped_file_unref(mapped);
+        return FALSE;
+    }
+    const AtlasFace *faces = (const AtlasFace *) (contents + sizeof(header));
+    for (guint i = 0; i < header.face_count; i++) {
+        if (faces[i].key >= header.key_count || faces[i].type >= KBT_COUNT
+            || faces[i].x + faces[i].width > header.width || faces[i].y + faces[i].height > header.height) {
+            D printf("atlas invalid face\n");
+            g_mapped_file_unref(mapped);
+            return FALSE;
+        }
+    }
+    // atlas pixbuf keeps mapping until last face is released
+    guchar *pixels = (guchar *) contents + sizeof(header) + faces_size;
+    GdkPixbuf *atlas = gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, TRUE, 8,
+                                                (gint) header.width, (gint) header.height, (gint) header.rowstride,
+                                                atlas_unmap_cb, mapped);
+    for (guint i = 0; i < header.face_count; i++) {
+        Key *key = &keyboard->keys[faces[i].key];
+        if (key->pixbuf[faces[i].type]) { g_object_unref(key->pixbuf[faces[i].type]); }
+        key->pixbuf[faces[i].type] = gdk_pixbuf_new_subpixbuf(atlas, (gint) faces[i].x, (gint) faces[i].y,
+                                                              (gint) faces[i].width, (gint) faces[i].height);
+    }
+    g_object_unref(atlas);
+    keyboard->unit_width = header.unit_width;
+    keyboard->unit_height = header.unit_height;
+    keyboard->measured = TRUE;
+    keyboard_geometry_invalidate(keyboard);
+    D printf("atlas loaded: %u faces\n", header.face_count);
+    return TRUE;
+}
+
+/**
+ * Render label to pixbuf
+ * @param keyboard Keyboard structure
+ * @param label Label text
+ * @return Pixbuf with alpha channel, null if label is empty
+ */
+static GdkPixbuf * atlas_render_label(Keyboard *keyboard, const gchar *label) {
+    gint width = 0;
+    gint height = 0;
+    pango_layout_set_text(keyboard->pango_layout, label, -1);
+    pango_layout_get_pixel_size(keyboard->pango_layout, &width, &height);
+    if (width <= 0 || height <= 0) {
+        return NULL;
+    }
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cairo_t *cr = cairo_create(surface);
+    keyboard_canvas_paint_label(keyboard, cr, label, 0, 0, width, height);
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+    const guchar *src = cairo_image_surface_get_data(surface);
+    const gint src_stride = cairo_image_surface_get_stride(surface);
+    guchar *dst = gdk_pixbuf_get_pixels(pixbuf);
+    const gint dst_stride = gdk_pixbuf_get_rowstride(pixbuf);
+    for (gint y = 0; y < height; y++) {
+        const guint32 *s = (const guint32 *) (src + y * src_stride);
+        guchar *d = dst + y * dst_stride;
+        for (gint x = 0; x < width; x++) {
+            // premultiplied native endian ARGB to RGBA
+            const guint32 p = s[x];
+            const guint a = p >> 24;
+            d[0] = (guchar) (a ? (((p >> 16) & 0xff) * 255 + a / 2) / a : 0);
+            d[1] = (guchar) (a ? (((p >> 8) & 0xff) * 255 + a / 2) / a : 0);
+            d[2] = (guchar) (a ? ((p & 0xff) * 255 + a / 2) / a : 0);
+            d[3] = (guchar) a;
+            d += 4;
+        }
+    }
+    cairo_surface_destroy(surface);
+    return pixbuf;
+}
+
+/**
+ * Rasterize all key faces into atlas and save it to cache.
+ * Must be called after keys were measured, all variant images are loaded.
+ * Labels are rendered only for canvas keyboard, buttons draw their own labels.
+ * @param keyboard Keyboard structure
+ * @param path Atlas path
+ * @param hash Atlas digest
+ */
+void keyboard_atlas_save(Keyboard *keyboard, const gchar *path, const guint8 *hash) {
+    gint64 start = g_get_monotonic_time();
+    const guint max_faces = keyboard->key_count * KBT_COUNT;
+    GdkPixbuf **images = g_malloc0(max_faces * sizeof(GdkPixbuf *));
+    AtlasFace *faces = g_malloc0(max_faces * sizeof(AtlasFace));
+    AtlasHeader header;
+    memset(&header, 0, sizeof(header));
+    header.width = ATLAS_WIDTH;
+    // render faces and pack them into shelves
+    guint x = 0;
+    guint y = 0;
+    guint shelf_height = 0;
+    for (guint i = 0; i < keyboard->key_count; i++) {
+        Key *key = &keyboard->keys[i];
+        if (key->space) { continue; }
+        for (gint type = 0; type < KBT_COUNT; type++) {
+            GdkPixbuf *image = NULL;
+            keyboard_key_materialize(key, type);
+            if (key->pixbuf[type]) {
+                image = g_object_ref(key->pixbuf[type]);
+            } else if (keyboard->canvas && key->label[type]) {
+                image = atlas_render_label(keyboard, key->label[type]);
+            }
+            if (image == NULL) { continue; }
+            AtlasFace *face = &faces[header.face_count];
+            face->key = i;
+            face->type = (guint32) type;
+            face->width = (guint32) gdk_pixbuf_get_width(image);
+            face->height = (guint32) gdk_pixbuf_get_height(image);
+            header.width = MAX(header.width, face->width);
+            if (x + face->width > header.width) {
+                x = 0;
+                y += shelf_height;
+                shelf_height = 0;
+            }
+            face->x = x;
+            face->y = y;
+            x += face->width;
+            shelf_height = MAX(shelf_height, face->height);
+            images[header.face_count++] = image;
+        }
+    }
+    header.height = y + shelf_height;
+    if (header.face_count == 0 || header.height == 0) {
+        g_free(images);
+        g_free(faces);
+        return;
+    }
+    GdkPixbuf *atlas = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, (gint) header.width, (gint) header.height);
+    gdk_pixbuf_fill(atlas, 0);
+    for (guint i = 0; i < header.face_count; i++) {
+        gdk_pixbuf_copy_area(images[i], 0, 0, (gint) faces[i].width, (gint) faces[i].height,
+                             atlas, (gint) faces[i].x, (gint) faces[i].y);
+        g_object_unref(images[i]);
+    }
+    g_free(images);
+    header.magic = ATLAS_MAGIC;
+    header.version = ATLAS_VERSION;
+    memcpy(header.hash, hash, KB_ATLAS_HASH_LEN);
+    header.key_count = keyboard->key_count;
+    header.unit_width = keyboard->unit_width;
+    header.unit_height = keyboard->unit_height;
+    header.rowstride = (guint32) gdk_pixbuf_get_rowstride(atlas);
+    const gsize faces_size = header.face_count * sizeof(AtlasFace);
+    const gsize pixels_size = (gsize) header.rowstride * header.height;
+    const gsize length = sizeof(header) + faces_size + pixels_size;
+    gchar *contents = g_malloc(length);
+    memcpy(contents, &header, sizeof(header));
+    memcpy(contents + sizeof(header), faces, faces_size);
+    memcpy(contents + sizeof(header) + faces_size, gdk_pixbuf_get_pixels(atlas), pixels_size);
+    g_free(faces);
+    g_object_unref(atlas);
+    gchar *dir = g_path_get_dirname(path);
+    GError *error = NULL;
+    if (g_mkdir_with_parents(dir, 0755) == 0) {
+        g_file_set_contents(path, contents, (gssize) length, &error);
+    }
+    if G_UNLIKELY(error) {
+        D printf("Saving atlas failed: %s\n", error->message);
+        g_error_free(error);
+    }
+    g_free(dir);
+    g_free(contents);
+    D printf("atlas saved: %u faces, %ux%u in %" G_GINT64_FORMAT " us\n",
+             header.face_count, header.width, header.height, g_get_monotonic_time() - start);
+}
@@ -0,0 +1,267 @@
+/* keyboard_canvas.c
+ *
+ * This file is part of kterm
+ *
+ * Copyright(C) 2016 Bartek Fabiszewski (www.fabiszewski.net)
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <gtk/gtk.h>
+#include "keyboard.h"
+#include "config.h"
+
+/** Canvas background color */
+static const gdouble canvas_bg[] = { 1.0, 1.0, 1.0 };
+/** Key background color */
+static const gdouble key_bg[] = { 0.94, 0.94, 0.94 };
+/** Pressed key background color */
+static const gdouble key_bg_active[] = { 0.63, 0.63, 0.63 };
+/** Key border color */
+static const gdouble key_border[] = { 0.5, 0.5, 0.5 };
+/** Key label color */
+static const gdouble key_fg[] = { 0.0, 0.0, 0.0 };
+
+/**
+ * Calculate key areas from key widths and canvas allocation
+ * @param keyboard Keyboard structure
+ */
+void keyboard_canvas_layout(Keyboard *keyboard) {
+    GtkAllocation alloc;
+    gtk_widget_get_allocation(keyboard->widget, &alloc);
+    if (alloc.width <= 1 || alloc.height <= 1 || keyboard->row_count == 0) {
+        return;
+    }
+    Key *p = keyboard->keys;
+    for (guint i = 0; i < keyboard->row_count; i++) {
+        Key *row = p;
+        guint count = keyboard->key_per_row[i];
+        p += count;
+        gint y = alloc.height * (gint) i / (gint) keyboard->row_count;
+        gint height = alloc.height * (gint) (i + 1) / (gint) keyboard->row_count - y;
+        // fill keys share space left in a row
+        guint fixed = 0;
+        guint fill_count = 0;
+        for (guint j = 0; j < count; j++) {
+            fixed += row[j].pixel_width;
+            if (row[j].fill && row[j].pixel_width) { fill_count++; }
+        }
+        guint extra = ((guint) alloc.width > fixed && fill_count) ? ((guint) alloc.width - fixed) / fill_count : 0;
+        gint x = 0;
+        for (guint j = 0; j < count; j++) {
+            Key *key = &row[j];
+            gint width = (gint) key->pixel_width;
+            if (key->fill && width) { width += (gint) extra; }
+            key->rect.x = x;
+            key->rect.y = y;
+            key->rect.width = width;
+            key->rect.height = height;
+            x += width;
+        }
+    }
+    keyboard_index_build(keyboard);
+    gtk_widget_queue_draw(keyboard->widget);
+}
+
+/**
+ * Queue redraw of single key area
+ * @param key Key structure
+ */
+void keyboard_canvas_queue_key(const Key *key) {
+    const Keyboard *keyboard = key->keyboard;
+    if (keyboard->widget && key->rect.width) {
+        gtk_widget_queue_draw_area(keyboard->widget, key->rect.x, key->rect.y, key->rect.width, key->rect.height);
+    }
+}
+
+/**
+ * Paint label centered in given area
+ * @param keyboard Keyboard structure
+ * @param cr Cairo context
+ * @param label Label text
+ * @param x Area x position
+ * @param y Area y position
+ * @param width Area width
+ * @param height Area height
+ */
+void keyboard_canvas_paint_label(Keyboard *keyboard, cairo_t *cr, const gchar *label,
+                                 gdouble x, gdouble y, gdouble width, gdouble height) {
+    gint label_width = 0;
+    gint label_height = 0;
+    pango_layout_set_text(keyboard->pango_layout, label, -1);
+    pango_layout_get_pixel_size(keyboard->pango_layout, &label_width, &label_height);
+    cairo_set_source_rgb(cr, key_fg[0], key_fg[1], key_fg[2]);
+    cairo_move_to(cr, (gint) (x + (width - label_width) / 2), (gint) (y + (height - label_height) / 2));
+    pango_cairo_show_layout(cr, keyboard->pango_layout);
+}
+
+/**
+ * Paint single key, face images are loaded on first paint
+ * @param keyboard Keyboard structure
+ * @param cr Cairo context
+ * @param key Key structure
+ */
+static void canvas_paint_key(Keyboard *keyboard, cairo_t *cr, Key *key) {
+    const gdouble x = key->rect.x + KB_CANVAS_PADDING / 2.0;
+    const gdouble y = key->rect.y + KB_CANVAS_PADDING / 2.0;
+    const gdouble width = key->rect.width - KB_CANVAS_PADDING;
+    const gdouble height = key->rect.height - KB_CANVAS_PADDING;
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    const gdouble *bg = key->active ? key_bg_active : key_bg;
+    cairo_rectangle(cr, x + 0.5, y + 0.5, width - 1, height - 1);
+    cairo_set_source_rgb(cr, bg[0], bg[1], bg[2]);
+    cairo_fill_preserve(cr);
+    cairo_set_line_width(cr, 1);
+    cairo_set_source_rgb(cr, key_border[0], key_border[1], key_border[2]);
+    cairo_stroke(cr);
+
+    KBtype type = keyboard_key_face(key, keyboard->layout_state);
+    keyboard_key_materialize(key, type);
+    if (key->pixbuf[type]) {
+        gint image_width = gdk_pixbuf_get_width(key->pixbuf[type]);
+        gint image_height = gdk_pixbuf_get_height(key->pixbuf[type]);
+        gdk_cairo_set_source_pixbuf(cr, key->pixbuf[type],
+                                    (gint) (x + (width - image_width) / 2),
+                                    (gint) (y + (height - image_height) / 2));
+        cairo_paint(cr);
+    } else if (key->label[type]) {
+        keyboard_canvas_paint_label(keyboard, cr, key->label[type], x, y, width, height);
+    }
+}
+
+/**
+ * Paint keys intersecting clip area
+ * @param keyboard Keyboard structure
+ * @param cr Cairo context
+ * @param clip Area to paint
+ */
+static void canvas_paint(Keyboard *keyboard, cairo_t *cr, const GdkRectangle *clip) {
+    guint painted = 0;
+    cairo_set_source_rgb(cr, canvas_bg[0], canvas_bg[1], canvas_bg[2]);
+    gdk_cairo_rectangle(cr, clip);
+    cairo_fill(cr);
+    for (guint i = 0; i < keyboard->key_count; i++) {
+        Key *key = &keyboard->keys[i];
+        if (key->space || key->rect.width == 0) { continue; }
+        GdkRectangle area;
+        if (!gdk_rectangle_intersect(&key->rect, clip, &area)) { continue; }
+        cairo_save(cr);
+        canvas_paint_key(keyboard, cr, key);
+        cairo_restore(cr);
+        painted++;
+    }
+    D printf("canvas paint %ix%i+%i+%i: %u keys\n", clip->width, clip->height, clip->x, clip->y, painted);
+}
+
+#if GTK_CHECK_VERSION(3,0,0)
+/**
+ * Canvas draw signal handler
+ * @param widget Canvas widget
+ * @param cr Cairo context
+ * @param keyboard Keyboard structure
+ * @return Always false to propagate event
+ */
+static gboolean canvas_draw_cb(GtkWidget *widget, cairo_t *cr, Keyboard *keyboard) {
+    UNUSED(widget);
+    GdkRectangle clip;
+    if (gdk_cairo_get_clip_rectangle(cr, &clip)) {
+        canvas_paint(keyboard, cr, &clip);
+    }
+    return FALSE;
+}
+#else
+/**
+ * Canvas expose event handler
+ * @param widget Canvas widget
+ * @param event Expose event
+ * @param keyboard Keyboard structure
+ * @return Always false to propagate event
+ */
+static gboolean canvas_expose_cb(GtkWidget *widget, GdkEventExpose *event, Keyboard *keyboard) {
+    cairo_t *cr = gdk_cairo_create(gtk_widget_get_window(widget));
+    gdk_cairo_rectangle(cr, &event->area);
+    cairo_clip(cr);
+    canvas_paint(keyboard, cr, &event->area);
+    cairo_destroy(cr);
+    return FALSE;
+}
+#endif
+
+/**
+ * Canvas size allocation signal handler
+ * @param widget Canvas widget
+ * @param alloc Size allocation
+ * @param keyboard Keyboard structure
+ */
+static void canvas_size_allocate_cb(GtkWidget *widget, GtkAllocation *alloc, Keyboard *keyboard) {
+    UNUSED(widget);
+    UNUSED(alloc);
+    keyboard_canvas_layout(keyboard);
+}
+
+/**
+ * Measure keys and load default key images, using atlas when available
+ * @param keyboard Keyboard structure with canvas widget
+ */
+void keyboard_canvas_prepare(Keyboard *keyboard) {
+    GtkWidget *canvas = keyboard->widget;
+    gint64 start = g_get_monotonic_time();
+    guint8 atlas_hash[KB_ATLAS_HASH_LEN];
+    gchar *atlas_path = keyboard_atlas_path(keyboard, canvas, atlas_hash);
+    if (!keyboard_atlas_load(keyboard, atlas_path, atlas_hash)) {
+        for (guint i = 0; i < keyboard->key_count && !keyboard->measured; i++) {
+            Key *key = &keyboard->keys[i];
+            if (key->space) { continue; }
+            for (gint type = 0; type < KBT_COUNT; type++) {
+                keyboard_key_measure(key, type, canvas);
+            }
+        }
+        keyboard_atlas_save(keyboard, atlas_path, atlas_hash);
+    }
+    g_free(atlas_path);
+    for (guint i = 0; i < keyboard->key_count; i++) {
+        keyboard_key_materialize(&keyboard->keys[i], KBT_DEFAULT);
+    }
+    D printf("canvas keys prepared in %" G_GINT64_FORMAT " us\n", g_get_monotonic_time() - start);
+}
+
+/**
+ * Build canvas widget, measure keys and load default key images
+ * @param keyboard Keyboard structure
+ */
+void keyboard_canvas_build(Keyboard *keyboard) {
+    GtkWidget *canvas = gtk_drawing_area_new();
+    gtk_widget_set_name(canvas, "ktermKbCanvas");
+    gtk_widget_set_can_focus(canvas, FALSE);
+    gtk_widget_add_events(canvas, GDK_BUTTON_PRESS_MASK | GDK_BUTTON_RELEASE_MASK | GDK_BUTTON_MOTION_MASK);
+    keyboard->widget = canvas;
+    keyboard->pango_layout = gtk_widget_create_pango_layout(canvas, NULL);
+    keyboard_canvas_prepare(keyboard);
+#if GTK_CHECK_VERSION(3,0,0)
+    g_signal_connect(canvas, "draw", G_CALLBACK(canvas_draw_cb), keyboard);
+#else
+    g_signal_connect(canvas, "expose-event", G_CALLBACK(canvas_expose_cb), keyboard);
+#endif
+    g_signal_connect(canvas, "size-allocate", G_CALLBACK(canvas_size_allocate_cb), keyboard);
+    g_signal_connect(canvas, "button-press-event", G_CALLBACK(keyboard_area_event), keyboard);
+    g_signal_connect(canvas, "button-release-event", G_CALLBACK(keyboard_area_event), keyboard);
+    g_signal_connect(canvas, "motion-notify-event", G_CALLBACK(keyboard_area_event), keyboard);
+#if GTK_CHECK_VERSION(3,4,0)
+    gtk_widget_add_events(canvas, GDK_TOUCH_MASK);
+    g_signal_connect(canvas, "touch-event", G_CALLBACK(keyboard_area_event), keyboard);
+#endif
+}
@@ -0,0 +1,94 @@
+/* keyboard_pixbuf.c
+ *
+ * This file is part of kterm
+ *
+ * Copyright(C) 2016 Bartek Fabiszewski (www.fabiszewski.net)
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <gtk/gtk.h>
+#include "keyboard.h"
+#include "config.h"
+
+/** Decoded key images by path, pixbufs are not owned by cache */
+static GHashTable *pixbuf_cache = NULL;
+/** Count of cache hits */
+static guint pixbuf_hits = 0;
+/** Count of bytes not allocated thanks to cache hits */
+static gsize pixbuf_saved = 0;
+
+/**
+ * Pixbuf finalize notification, removes pixbuf from cache
+ * @param data Image path (cache key)
+ * @param pixbuf Finalized pixbuf
+ */
+static void pixbuf_cache_remove(gpointer data, GObject *pixbuf) {
+    UNUSED(pixbuf);
+    g_hash_table_remove(pixbuf_cache, data);
+    if (g_hash_table_size(pixbuf_cache) == 0) {
+        D printf("pixbuf cache: %u hits, %" G_GSIZE_FORMAT " bytes saved\n", pixbuf_hits, pixbuf_saved);
+        g_hash_table_destroy(pixbuf_cache);
+        pixbuf_cache = NULL;
+    }
+}
+
+/**
+ * Get key image pixbuf, decoding image only once for each path.
+ * Pixbuf stays in cache until all references are dropped.
+ * @param path Image path
+ * @param error Error
+ * @return Pixbuf with new reference, to be released with g_object_unref(), null on failure
+ */
+GdkPixbuf * keyboard_pixbuf_get(const gchar *path, GError **error) {
+    if (pixbuf_cache == NULL) {
+        pixbuf_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    GdkPixbuf *pixbuf = g_hash_table_lookup(pixbuf_cache, path);
+    if (pixbuf) {
+        pixbuf_hits++;
+        pixbuf_saved += (gsize) gdk_pixbuf_get_rowstride(pixbuf) * (gsize) gdk_pixbuf_get_height(pixbuf);
+        D printf("pixbuf cache hit: %s (%u hits, %" G_GSIZE_FORMAT " bytes saved)\n", path, pixbuf_hits, pixbuf_saved);
+        return g_object_ref(pixbuf);
+    }
+    pixbuf = gdk_pixbuf_new_from_file(path, error);
+    if (pixbuf == NULL) {
+        return NULL;
+    }
+    gchar *key = g_strdup(path);
+    g_hash_table_insert(pixbuf_cache, key, pixbuf);
+    g_object_weak_ref(G_OBJECT(pixbuf), pixbuf_cache_remove, key);
+    return pixbuf;
+}
+
+/**
+ * Drop image from cache, so that it is decoded again on next use.
+ * Pixbufs already in use are not affected.
+ * @param path Image path
+ */
+void keyboard_pixbuf_forget(const gchar *path) {
+    gpointer key = NULL;
+    gpointer pixbuf = NULL;
+    if (pixbuf_cache == NULL || !g_hash_table_lookup_extended(pixbuf_cache, path, &key, &pixbuf)) {
+        return;
+    }
+    D printf("pixbuf cache forget: %s\n", path);
+    g_object_weak_unref(G_OBJECT(pixbuf), pixbuf_cache_remove, key);
+    g_hash_table_remove(pixbuf_cache, path);
+    if (g_hash_table_size(pixbuf_cache) == 0) {
+        g_hash_table_destroy(pixbuf_cache);
+        pixbuf_cache = NULL;
+    }
+}
@@ -0,0 +1,274 @@
+/* kterm-layout.c
+ *
+ * This file is part of kterm
+ *
+ * Copyright(C) 2016 Bartek Fabiszewski (www.fabiszewski.net)
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Keyboard layout compiler and validator.
+ * Parses layout with kterm parser without building any widgets,
+ * so it runs without display, eg. on build host.
+ */
+
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include "keyboard.h"
+#include "config.h"
+
+/** Global config */
+KTconf *conf;
+/** Global debug */
+gboolean debug = FALSE;
+
+/** Layout variant names */
+static const gchar *variant_names[KBT_COUNT] = { "default", "shifted", "mod1", "mod2", "mod3" };
+
+/**
+ * Print usage info and exit
+ */
+static void usage(void) {
+    printf("Usage: kterm-layout [OPTIONS] <layout.xml>\n");
+    printf("        -b <count>    benchmark parser, repeat parsing count times\n");
+    printf("        -c <path>     write compiled layout as C source\n");
+    printf("        -d            debug mode\n");
+    printf("        -h            show this message\n");
+    printf("        -n <name>     array name in C source (default kterm_layout)\n");
+    printf("        -o <path>     write compiled layout in binary cache format\n");
+    printf("        -p <path>     installed layout path, relative images in compiled layout point next to it\n");
+    printf("        -r <dpi>      screen resolution used to choose key images\n");
+    exit(0);
+}
+
+/**
+ * Find layout by id
+ * @param keyboard First layout structure
+ * @param id Layout id
+ * @return True if found, false otherwise
+ */
+static gboolean layout_exists(const Keyboard *keyboard, const gchar *id) {
+    for (guint i = 0; i < keyboard->layout_count; i++) {
+        if (!g_strcmp0(keyboard->layouts[i]->id, id)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Print layout statistics and problems
+ * @param keyboard First layout structure
+ * @return Count of problems found
+ */
+static guint layout_report(const Keyboard *keyboard) {
+    guint problems = 0;
+    for (guint l = 0; l < keyboard->layout_count; l++) {
+        const Keyboard *layout = keyboard->layouts[l];
+        guint coverage[KBT_COUNT] = { 0 };
+        guint buttons = 0;
+        printf("Layout %u%s%s: %u keys in %u rows\n", l, layout->id ? " " : "", layout->id ? layout->id : "",
+               layout->key_count, layout->row_count);
+        printf("  keys per row:");
+        for (guint i = 0; i < layout->row_count; i++) {
+            printf(" %u", layout->key_per_row[i]);
+        }
+        printf("\n");
+        const Key *row = layout->keys;
+        for (guint r = 0; r < layout->row_count; r++) {
+            for (guint i = 0; i < layout->key_per_row[r]; i++) {
+                const Key *key = &row[i];
+                if (key->space) { continue; }
+                buttons++;
+                for (gint type = 0; type < KBT_COUNT; type++) {
+                    const gchar *face = key->image_path[type] ? key->image_path[type] : key->label[type];
+                    if (face == NULL) { continue; }
+                    coverage[type]++;
+                    if (key->image_path[type] && !g_file_test(key->image_path[type], G_FILE_TEST_IS_REGULAR)) {
+                        printf("  row %u key %u %s: missing image %s\n", r + 1, i + 1, variant_names[type], key->image_path[type]);
+                        problems++;
+                    }
+                    if (key->layout_id[type] && !layout_exists(keyboard, key->layout_id[type])) {
+                        printf("  row %u key %u %s: unknown layout %s\n", r + 1, i + 1, variant_names[type], key->layout_id[type]);
+                        problems++;
+                    }
+                    if (!key->modifier && !key->keyval[type] && !key->sequence[type] && !key->layout_id[type]) {
+                        printf("  row %u key %u %s: unresolved keyval for %s\n", r + 1, i + 1, variant_names[type], face);
+                        problems++;
+                    }
+                }
+            }
+            row += layout->key_per_row[r];
+        }
+        printf("  variant coverage:");
+        for (gint type = 0; type < KBT_COUNT; type++) {
+            printf(" %s %u/%u", variant_names[type], coverage[type], buttons);
+        }
+        printf("\n");
+    }
+    return problems;
+}
+
+/**
+ * Move image paths resolved relative to layout next to installed layout
+ * @param keyboard First layout structure
+ * @param path Layout path
+ * @param install_path Installed layout path
+ */
+static void layout_rebase(Keyboard *keyboard, const gchar *path, const gchar *install_path) {
+    gchar *dir = g_path_get_dirname(path);
+    gchar *install_dir = g_path_get_dirname(install_path);
+    const gsize dir_len = strlen(dir);
+    const gboolean bare = (strchr(path, '/') == NULL);
+    for (guint l = 0; l < keyboard->layout_count; l++) {
+        Keyboard *layout = keyboard->layouts[l];
+        for (guint i = 0; i < layout->key_count; i++) {
+            Key *key = &layout->keys[i];
+            for (gint type = 0; type < KBT_COUNT; type++) {
+                const gchar *image = key->image_path[type];
+                gchar *rebased = NULL;
+                if (image == NULL) {
+                    continue;
+                } else if (bare && !g_path_is_absolute(image)) {
+                    rebased = g_build_filename(install_dir, image, NULL);
+                } else if (!bare && !strncmp(image, dir, dir_len) && image[dir_len] == '/') {
+                    rebased = g_strconcat(install_dir, &image[dir_len], NULL);
+                }
+                if (rebased) {
+                    key->image_path[type] = g_string_chunk_insert_const(layout->strings, rebased);
+                    g_free(rebased);
+                }
+            }
+        }
+    }
+    g_free(dir);
+    g_free(install_dir);
+}
+
+/**
+ * Repeat parsing and print timings
+ * @param path Layout path
+ * @param asset_suffix Image directory suffix, may be null
+ * @param count Repeat count
+ */
+static void layout_benchmark(const gchar *path, const gchar *asset_suffix, guint count) {
+    gint64 total = 0;
+    gint64 min = G_MAXINT64;
+    gint64 max = 0;
+    for (guint i = 0; i < count; i++) {
+        GError *error = NULL;
+        gint64 start = g_get_monotonic_time();
+        Keyboard *keyboard = parse_layout(path, asset_suffix, &error);
+        gint64 elapsed = g_get_monotonic_time() - start;
+        if (keyboard) {
+            keyboard_free(&keyboard);
+        } else {
+            g_error_free(error);
+        }
+        total += elapsed;
+        if (elapsed < min) { min = elapsed; }
+        if (elapsed > max) { max = elapsed; }
+    }
+    printf("Parsed %u times: min %" G_GINT64_FORMAT " us, avg %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us\n",
+           count, min, total / count, max);
+}
+
+gint main(gint argc, gchar **argv) {
+    conf = parse_config();
+    gint c;
+    guint bench = 0;
+    gdouble dpi = 0;
+    const gchar *bin_path = NULL;
+    const gchar *c_path = NULL;
+    const gchar *install_path = NULL;
+    const gchar *name = "kterm_layout";
+    while((c = getopt(argc, argv, "b:c:dhn:o:p:r:")) != -1) {
+        switch(c) {
+            case 'b':
+                bench = (guint) atoi(optarg);
+                break;
+            case 'c':
+                c_path = optarg;
+                break;
+            case 'd':
+                debug = TRUE;
+                break;
+            case 'h':
+                usage();
+                break;
+            case 'n':
+                name = optarg;
+                break;
+            case 'o':
+                bin_path = optarg;
+                break;
+            case 'p':
+                install_path = optarg;
+                break;
+            case 'r':
+                dpi = atof(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+    }
+    const gchar *path = argv[optind];
+    const gchar *asset_suffix = layout_asset_suffix(dpi);
+    // relative image paths are resolved against layout path, as in kterm
+    snprintf(conf->kb_conf_path, sizeof(conf->kb_conf_path), "%s", path);
+
+    GError *error = NULL;
+    gint64 start = g_get_monotonic_time();
+    Keyboard *keyboard = parse_layout(path, asset_suffix, &error);
+    gint64 elapsed = g_get_monotonic_time() - start;
+    if (keyboard == NULL) {
+        fprintf(stderr, "%s: %s\n", path, error->message);
+        g_error_free(error);
+        g_free(conf);
+        return 1;
+    }
+    printf("%s: parsed in %" G_GINT64_FORMAT " us\n", path, elapsed);
+    guint problems = layout_report(keyboard);
+    if (bench) {
+        layout_benchmark(path, asset_suffix, bench);
+    }
+    gint ret = problems ? 2 : 0;
+    if (install_path) {
+        layout_rebase(keyboard, path, install_path);
+    }
+    if (bin_path && !layout_cache_write(keyboard, path, asset_suffix, bin_path, &error)) {
+        fprintf(stderr, "%s: %s\n", bin_path, error->message);
+        g_clear_error(&error);
+        ret = 1;
+    }
+    if (c_path && !layout_cache_write_c(keyboard, path, asset_suffix, c_path, name, &error)) {
+        fprintf(stderr, "%s: %s\n", c_path, error->message);
+        g_clear_error(&error);
+        ret = 1;
+    }
+    if (problems) {
+        printf("%u problems found\n", problems);
+    }
+    keyboard_free(&keyboard);
+    g_free(conf);
+    return ret;
+}
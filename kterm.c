@@ -20,6 +20,9 @@
  */
 
 #include <gtk/gtk.h>
+#if GLIB_CHECK_VERSION(2,30,0)
+#include <glib-unix.h>
+#endif
 #include <vte/vte.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -29,6 +32,7 @@
 #include <signal.h>
 #include <getopt.h>
 #include "keyboard.h"
+#include "suggest.h"
 #ifdef KINDLE
 #include "kindle.h"
 #endif
@@ -73,6 +77,7 @@ static void install_signal_handlers(void) {
  */
 static void clean_on_exit(Keyboard *keyboard) {
     D printf("cleanup\n");
+    keyboard_release_flush(keyboard);
 #ifdef KINDLE
     keyboard_grab(NULL, FALSE);
     orientation_restore();
@@ -94,9 +99,18 @@ static void grab_focus(GtkWidget *widget, gpointer data) {
 
 /**
  * Terminal exit handler
+ * @param terminal Terminal
+ * @param status Child exit status
+ * @param keyboard Keyboard structure
  */
-static void terminal_exit(void) {
-    sleep(1); // time for kb to send key up event
+#if VTE_CHECK_VERSION(0,38,0)
+static void terminal_exit(VteTerminal *terminal, gint status, Keyboard *keyboard) {
+    UNUSED(status);
+#else
+static void terminal_exit(VteTerminal *terminal, Keyboard *keyboard) {
+#endif
+    UNUSED(terminal);
+    keyboard_release_flush(keyboard); // send pending key up events
     gtk_main_quit();
 }
 
@@ -142,6 +156,19 @@ static void set_terminal_font(VteTerminal *terminal, const gchar *font_family, c
     pango_font_description_free(desc);
 }
 
+/**
+ * Set terminal encoding
+ * @param terminal Terminal
+ * @param encoding Encoding name
+ */
+static void set_terminal_encoding(VteTerminal *terminal, const gchar *encoding) {
+#if VTE_CHECK_VERSION(0,38,0)
+    vte_terminal_set_encoding(terminal, encoding, NULL);
+#else
+    vte_terminal_set_encoding(terminal, encoding);
+#endif
+}
+
 /**
  * Resize terminal font
  * @param terminal Terminal
@@ -293,7 +320,7 @@ static void keyboard_update(GtkWidget *keyboard_box, GtkAllocation *alloc, Keybo
     static gint saved_height = -1;
     if (conf->kb_on && alloc && (alloc->width != saved_width || screen_height != saved_height)) {
         D printf("set keyboard size: %ix%i\n", alloc->width, alloc->height);
-        g_idle_add(keyboard_set_size, keyboard);
+        keyboard_queue_size(keyboard);
         saved_width = alloc->width;
         saved_height = screen_height;
     }
@@ -330,6 +357,20 @@ static void reset_terminal(GtkWidget *widget, gpointer terminal) {
     vte_terminal_reset(terminal, TRUE, TRUE);
 }
 
+/**
+ * Show or hide keyboard
+ * @param keyboard_box Keyboard container
+ * @param visible True to show keyboard
+ */
+static void set_keyboard_visible(GtkWidget *keyboard_box, gboolean visible) {
+    if (visible) {
+        gtk_widget_show(keyboard_box);
+    } else {
+        gtk_widget_hide(keyboard_box);
+    }
+    conf->kb_on = visible;
+}
+
 /**
  * Toggle keyboard menu callback
  * @param widget Calling widget
@@ -346,14 +387,192 @@ static void toggle_keyboard(GtkWidget *widget, gpointer box) {
     }
     g_list_free(box_list);
     if (keyboard_box) {
-        if (conf->kb_on) {
-            gtk_widget_hide(keyboard_box);
-            conf->kb_on = FALSE;
+        set_keyboard_visible(keyboard_box, !conf->kb_on);
+    }
+}
+
+/**
+ * Config reload state
+ */
+typedef struct {
+    KTconf *file_conf; /** Config file values applied last */
+    GtkWidget *terminal; /** Terminal */
+    GtkWidget *keyboard_box; /** Keyboard container */
+    Keyboard *keyboard; /** Keyboard structure, may be null */
+    GFileMonitor *monitor; /** Config file monitor */
+    guint source; /** Debounced reload source id, zero if none */
+    guint signal_source; /** SIGHUP source id, zero if none */
+} KTreload;
+
+/**
+ * Reparse config file and apply changed settings to running terminal.
+ * New values are compared with values read from file before, not with current config,
+ * so that command line options and menu changes stay until the setting is edited in file.
+ * @param reload Reload state
+ */
+static void config_reload(KTreload *reload) {
+    gint64 start = g_get_monotonic_time();
+    KTconf *old_conf = reload->file_conf;
+    KTconf *new_conf = parse_config();
+    VteTerminal *terminal = VTE_TERMINAL(reload->terminal);
+    guint changed = 0;
+    if (strcmp(old_conf->font_family, new_conf->font_family) || old_conf->font_size != new_conf->font_size) {
+        snprintf(conf->font_family, sizeof(conf->font_family), "%s", new_conf->font_family);
+        conf->font_size = new_conf->font_size;
+        set_terminal_font(terminal, conf->font_family, (gint) conf->font_size);
+        changed++;
+    }
+    if (old_conf->color_reversed != new_conf->color_reversed) {
+        set_terminal_colors(reload->terminal, new_conf->color_reversed);
+        changed++;
+    }
+#if VTE_CHECK_VERSION(0,20,0)
+    if (old_conf->cursor_shape != new_conf->cursor_shape) {
+        conf->cursor_shape = new_conf->cursor_shape;
+        set_terminal_cursor(terminal, conf->cursor_shape);
+        changed++;
+    }
+#endif
+    if (strcmp(old_conf->encoding, new_conf->encoding)) {
+        snprintf(conf->encoding, sizeof(conf->encoding), "%s", new_conf->encoding);
+        set_terminal_encoding(terminal, conf->encoding);
+        changed++;
+    }
+    if (old_conf->kb_on != new_conf->kb_on) {
+        set_keyboard_visible(reload->keyboard_box, new_conf->kb_on);
+        changed++;
+    }
+    if (old_conf->kb_direct != new_conf->kb_direct) {
+        conf->kb_direct = new_conf->kb_direct;
+        keyboard_set_terminal(reload->keyboard, reload->terminal);
+        changed++;
+    }
+    if (old_conf->kb_slop != new_conf->kb_slop) {
+        conf->kb_slop = new_conf->kb_slop;
+        // hit index of active layout is rebuilt now, others when they are shown
+        if (reload->keyboard) { keyboard_index_build(reload->keyboard->root->active); }
+        changed++;
+    }
+    // read by keyboard on use
+    if (old_conf->kb_repeat_delay != new_conf->kb_repeat_delay
+        || old_conf->kb_repeat_interval != new_conf->kb_repeat_interval || old_conf->kb_repeat_accel != new_conf->kb_repeat_accel) {
+        conf->kb_repeat_delay = new_conf->kb_repeat_delay;
+        conf->kb_repeat_interval = new_conf->kb_repeat_interval;
+        conf->kb_repeat_accel = new_conf->kb_repeat_accel;
+        changed++;
+    }
+#ifdef KINDLE
+    if (old_conf->orientation != new_conf->orientation && new_conf->orientation && set_orientation(new_conf->orientation)) {
+        conf->orientation = new_conf->orientation;
+        changed++;
+    }
+#endif
+    D {
+        if (old_conf->kb_canvas != new_conf->kb_canvas || old_conf->kb_reload != new_conf->kb_reload
+            || old_conf->kb_suggest != new_conf->kb_suggest || old_conf->kb_suggest_save != new_conf->kb_suggest_save
+            || strcmp(old_conf->kb_conf_path, new_conf->kb_conf_path)) {
+            printf("keyboard engine, layout path, reload and suggestion settings need restart\n");
+        }
+    }
+    g_free(old_conf);
+    reload->file_conf = new_conf;
+    D printf("config reloaded: %u settings changed in %" G_GINT64_FORMAT " us\n",
+             changed, g_get_monotonic_time() - start);
+}
+
+/**
+ * Config reload timer callback
+ * @param data Reload state
+ * @return Always false to cancel timeout, as called with g_timeout_add()
+ */
+static gboolean config_reload_timeout(gpointer data) {
+    KTreload *reload = data;
+    reload->source = 0;
+    config_reload(reload);
+    return FALSE;
+}
+
+/**
+ * Config file monitor changed signal handler.
+ * Reload is scheduled after CONFIG_RELOAD_DEBOUNCE_MS without changes, so that editor writes are merged.
+ * @param monitor File monitor
+ * @param file Changed file
+ * @param other_file Unused
+ * @param event Event type
+ * @param reload Reload state
+ */
+static void config_changed_cb(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                              GFileMonitorEvent event, KTreload *reload) {
+    UNUSED(monitor);
+    UNUSED(file);
+    UNUSED(other_file);
+    if (event == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED || event == G_FILE_MONITOR_EVENT_DELETED) {
+        return;
+    }
+    if (reload->source) {
+        g_source_remove(reload->source);
+    }
+    reload->source = g_timeout_add(CONFIG_RELOAD_DEBOUNCE_MS, config_reload_timeout, reload);
+}
+
+#if GLIB_CHECK_VERSION(2,30,0)
+/**
+ * SIGHUP handler, dispatched from main loop
+ * @param data Reload state
+ * @return Always true to keep handler
+ */
+static gboolean config_hup_cb(gpointer data) {
+    D printf("reloading config on SIGHUP\n");
+    config_reload(data);
+    return TRUE;
+}
+#endif
+
+/**
+ * Watch config file and reload it on changes or SIGHUP
+ * @param file_conf Config values read from file, owned by reload state
+ * @param terminal Terminal
+ * @param keyboard_box Keyboard container
+ * @param keyboard Keyboard structure, may be null
+ * @return Reload state
+ */
+static KTreload * config_watch(KTconf *file_conf, GtkWidget *terminal, GtkWidget *keyboard_box, Keyboard *keyboard) {
+    KTreload *reload = g_new0(KTreload, 1);
+    reload->file_conf = file_conf;
+    reload->terminal = terminal;
+    reload->keyboard_box = keyboard_box;
+    reload->keyboard = keyboard;
+    gchar path[PATH_MAX];
+    config_path(path, sizeof(path));
+    if (path[0]) {
+        GError *error = NULL;
+        GFile *file = g_file_new_for_path(path);
+        reload->monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, &error);
+        g_object_unref(file);
+        if (reload->monitor) {
+            g_signal_connect(reload->monitor, "changed", G_CALLBACK(config_changed_cb), reload);
+            D printf("watching %s\n", path);
         } else {
-            gtk_widget_show(keyboard_box);
-            conf->kb_on = TRUE;
+            D printf("Watching %s failed: %s\n", path, error->message);
+            g_error_free(error);
         }
     }
+#if GLIB_CHECK_VERSION(2,30,0)
+    reload->signal_source = g_unix_signal_add(SIGHUP, config_hup_cb, reload);
+#endif
+    return reload;
+}
+
+/**
+ * Stop watching config and free reload state
+ * @param reload Reload state
+ */
+static void config_reload_free(KTreload *reload) {
+    if (reload->source) { g_source_remove(reload->source); }
+    if (reload->signal_source) { g_source_remove(reload->signal_source); }
+    if (reload->monitor) { g_object_unref(reload->monitor); }
+    g_free(reload->file_conf);
+    g_free(reload);
 }
 
 #ifdef KINDLE
@@ -553,11 +772,7 @@ static void setup_terminal(GtkWidget *terminal, gchar *command, gchar **envv, GE
 #if VTE_CHECK_VERSION(0,20,0)
     set_terminal_cursor(VTE_TERMINAL(terminal), conf->cursor_shape);
 #endif
-#if VTE_CHECK_VERSION(0,38,0)
-    vte_terminal_set_encoding(VTE_TERMINAL(terminal), conf->encoding, NULL);
-#else
-    vte_terminal_set_encoding(VTE_TERMINAL(terminal), conf->encoding);
-#endif
+    set_terminal_encoding(VTE_TERMINAL(terminal), conf->encoding);
     vte_terminal_set_allow_bold(VTE_TERMINAL(terminal), TRUE);
     
 #if VTE_CHECK_VERSION(0,38,0)
@@ -622,6 +837,9 @@ static void error_handle(GtkWidget *window, GError **error) {
 /** main */
 gint main(gint argc, gchar **argv) {
     conf = parse_config(); // call first so args overide defaults/config
+    // keep file values, config reload only applies settings changed in file
+    KTconf *file_conf = g_new(KTconf, 1);
+    *file_conf = *conf;
     
     gint c = -1;
     gint i = 0;
@@ -722,10 +940,25 @@ gint main(gint argc, gchar **argv) {
     GtkWidget *keyboard_box = gtk_vbox_new(TRUE, 0);
 #endif
     gtk_widget_set_name(keyboard_box, "kbBox");
+    // keyboard_box
+    //  \- suggestion strip  \- layout_box
+    GtkWidget *layout_box = keyboard_box;
+    if (conf->kb_suggest) {
+        gtk_box_set_homogeneous(GTK_BOX(keyboard_box), FALSE);
+#if GTK_CHECK_VERSION(3,0,0)
+        layout_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+        gtk_box_set_homogeneous(GTK_BOX(layout_box), TRUE);
+#else
+        layout_box = gtk_vbox_new(TRUE, 0);
+#endif
+        gtk_widget_set_name(layout_box, "kbLayoutBox");
+        gtk_box_pack_end(GTK_BOX(keyboard_box), layout_box, TRUE, TRUE, 0);
+    }
     
-    Keyboard *keyboard = build_layout(keyboard_box, &error);
+    Keyboard *keyboard = build_layout(layout_box, &error);
     if G_UNLIKELY(error) {
         error_handle(window, &error);
+        g_free(file_conf);
         clean_on_exit(keyboard);
         exit(1);
     }
@@ -736,16 +969,19 @@ gint main(gint argc, gchar **argv) {
     setup_terminal(terminal, command, envv, &error);
     if G_UNLIKELY(error) {
         error_handle(window, &error);
+        g_free(file_conf);
         clean_on_exit(keyboard);
         exit(1);
     }
     gtk_widget_set_name(terminal, "termBox");
+    keyboard_set_terminal(keyboard, terminal);
+    KTsuggest *suggest = conf->kb_suggest ? suggest_new(terminal, keyboard_box) : NULL;
     gtk_box_pack_start(GTK_BOX(vbox), terminal, TRUE, TRUE, 0);
     
     GtkWidget *menu = build_popup(terminal, vbox);
     // signals
     g_signal_connect(window, "delete_event", G_CALLBACK(gtk_main_quit), NULL);
-    g_signal_connect(terminal, "child-exited", G_CALLBACK(terminal_exit), NULL);
+    g_signal_connect(terminal, "child-exited", G_CALLBACK(terminal_exit), keyboard);
     g_signal_connect(terminal, "button-press-event", G_CALLBACK(button_event), menu);
     g_signal_connect(terminal, "button-release-event", G_CALLBACK(button_event), menu);
     g_signal_connect(terminal, "motion-notify-event", G_CALLBACK(button_event), menu);
@@ -762,9 +998,12 @@ gint main(gint argc, gchar **argv) {
         gtk_widget_hide(keyboard_box);
     }
     g_signal_connect(keyboard_box, "size-allocate", G_CALLBACK(keyboard_update), keyboard);
+    KTreload *reload = config_watch(file_conf, terminal, keyboard_box, keyboard);
     gtk_window_maximize(GTK_WINDOW(window));
     gtk_main();
     
+    config_reload_free(reload);
+    suggest_free(suggest);
     clean_on_exit(keyboard);
     gtk_widget_destroy(menu);
     D printf("the end\n");
@@ -0,0 +1,545 @@
+/* layout_cache.c
+ *
+ * This file is part of kterm
+ *
+ * Copyright(C) 2016 Bartek Fabiszewski (www.fabiszewski.net)
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include "keyboard.h"
+#include "config.h"
+
+/** Global config */
+extern KTconf *conf;
+
+/** Cache file magic */
+#define CACHE_MAGIC 0x4b544c31
+/** Cache file format version, change invalidates cached files */
+#define CACHE_VERSION 5
+/** Null string offset */
+#define CACHE_NONE G_MAXUINT32
+/** Length of SHA1 digest */
+#define CACHE_HASH_LEN 20
+
+/** Key flags */
+#define CACHE_KEY_OBEY_CAPS (1 << 0)
+#define CACHE_KEY_FILL (1 << 1)
+#define CACHE_KEY_EXTENDED (1 << 2)
+#define CACHE_KEY_SPACE (1 << 3)
+#define CACHE_KEY_REPEAT (1 << 4)
+#define CACHE_KEY_LOCK (1 << 5)
+#define CACHE_KEY_SWIPE (1 << 6)
+
+/**
+ * Cache file header
+ */
+typedef struct {
+    guint32 magic; /** File magic */
+    guint32 version; /** Format version */
+    gint64 mtime; /** Layout file modification time */
+    gint64 size; /** Layout file size */
+    guint8 hash[CACHE_HASH_LEN]; /** Layout file SHA1 digest */
+    guint32 suffix; /** Image directory suffix string */
+    guint32 metrics; /** Metrics id string, label metrics are valid only for same fonts and resolution */
+    guint32 layout_count; /** Layouts count */
+    guint32 key_count; /** Keys count in all layouts */
+    guint32 row_count; /** Rows count in all layouts */
+    guint32 strings_size; /** Size of strings table */
+} CacheHeader;
+
+/**
+ * Cached layout
+ */
+typedef struct {
+    guint32 id; /** Layout id string */
+    guint32 key_count; /** Keys count */
+    guint32 row_count; /** Rows count */
+    guint32 unit_width; /** Measured minimum unit width, zero if not measured */
+    guint32 unit_height; /** Measured minimum unit height */
+} CacheLayout;
+
+/**
+ * Cached key
+ */
+typedef struct {
+    guint32 flags; /** Key flags */
+    guint32 width; /** Forced width */
+    guint32 modifier; /** Modifier type */
+    guint32 alternates; /** Long press alternates string */
+    guint32 label[KBT_COUNT]; /** Label strings */
+    guint32 image_path[KBT_COUNT]; /** Image path strings */
+    guint32 action[KBT_COUNT]; /** Action kinds */
+    guint32 keyval[KBT_COUNT]; /** Keyvals */
+    guint32 sequence[KBT_COUNT]; /** Input sequence strings */
+    guint32 sequence_len[KBT_COUNT]; /** Input sequence lengths */
+    guint32 layout_id[KBT_COUNT]; /** Layout id strings */
+} CacheKey;
+
+/**
+ * Get cache path for layout
+ * @param path Layout path
+ * @param suffix Image directory suffix, may be null
+ * @return Cache path, to be freed with g_free()
+ */
+static gchar * cache_path(const gchar *path, const gchar *suffix) {
+    gchar *id = g_strdup_printf("%s|%s", path, suffix ? suffix : "");
+    gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, id, -1);
+    gchar *name = g_strdup_printf("layout-%s.bin", hash);
+    gchar *cache = g_build_filename(g_get_user_cache_dir(), "kterm", name, NULL);
+    g_free(id);
+    g_free(hash);
+    g_free(name);
+    return cache;
+}
+
+/**
+ * Get id of environment label metrics depend on
+ * @return Metrics id, to be freed with g_free()
+ */
+static gchar * cache_metrics_id(void) {
+    gchar *font = NULL;
+    gchar *theme = NULL;
+    gint dpi = 0;
+    GtkSettings *settings = gtk_settings_get_default();
+    GdkScreen *screen = gdk_screen_get_default();
+    if (settings) {
+        g_object_get(settings, "gtk-font-name", &font, "gtk-theme-name", &theme, NULL);
+    }
+    if (screen) {
+        dpi = (gint) gdk_screen_get_resolution(screen);
+    }
+    // without display (layout compiler) metrics never match runtime ones
+    gchar *id = g_strdup_printf("%s|%s|%i|%i|%i.%i", font ? font : "", theme ? theme : "", dpi, conf->kb_canvas,
+                                GTK_MAJOR_VERSION, GTK_MINOR_VERSION);
+    g_free(font);
+    g_free(theme);
+    return id;
+}
+
+/**
+ * Calculate SHA1 digest of layout file
+ * @param path Layout path
+ * @param hash Digest buffer
+ * @return True on success, false otherwise
+ */
+static gboolean cache_hash(const gchar *path, guint8 *hash) {
+    gchar *contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(path, &contents, &length, NULL)) {
+        return FALSE;
+    }
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(checksum, (const guchar *) contents, (gssize) length);
+    gsize hash_len = CACHE_HASH_LEN;
+    g_checksum_get_digest(checksum, hash, &hash_len);
+    g_checksum_free(checksum);
+    g_free(contents);
+    return TRUE;
+}
+
+/**
+ * Add string to strings table
+ * @param strings Strings table
+ * @param str String, may be null
+ * @param len String length
+ * @return String offset or CACHE_NONE for null
+ */
+static guint32 cache_string_add(GString *strings, const gchar *str, gsize len) {
+    if (str == NULL) {
+        return CACHE_NONE;
+    }
+    guint32 offset = (guint32) strings->len;
+    g_string_append_len(strings, str, (gssize) len);
+    g_string_append_c(strings, '\0');
+    return offset;
+}
+
+/**
+ * Get string from strings table
+ * @param strings Strings table
+ * @param size Strings table size
+ * @param offset String offset
+ * @param valid Cleared if offset is invalid
+ * @return String or null
+ */
+static const gchar * cache_string(const gchar *strings, guint32 size, guint32 offset, gboolean *valid) {
+    if (offset == CACHE_NONE) {
+        return NULL;
+    }
+    if (offset >= size || memchr(strings + offset, '\0', size - offset) == NULL) {
+        *valid = FALSE;
+        return NULL;
+    }
+    return strings + offset;
+}
+
+/**
+ * Intern string in layout strings chunk
+ * @param keyboard Keyboard structure
+ * @param str String, may be null
+ * @return Interned string or null
+ */
+static gchar * cache_string_intern(Keyboard *keyboard, const gchar *str) {
+    return str ? g_string_chunk_insert_const(keyboard->strings, str) : NULL;
+}
+
+/**
+ * Build layouts from binary cache data. Data is valid if layout file modification time and size,
+ * or its contents digest match, and images were resolved for the same screen resolution.
+ * Embedded data is also valid if layout file is missing.
+ * Cache file accepted by digest or without metrics is marked stale, to be rewritten by caller.
+ * @param contents Cache data, aligned for cache structures
+ * @param length Cache data length
+ * @param path Layout path
+ * @param suffix Image directory suffix, may be null
+ * @param embedded Data is compiled in, layout file is optional
+ * @return First layout structure, null if data is invalid
+ */
+static Keyboard * cache_load(const gchar *contents, gsize length, const gchar *path, const gchar *suffix, gboolean embedded) {
+    CacheHeader header;
+    if (length < sizeof(header)) {
+        return NULL;
+    }
+    memcpy(&header, contents, sizeof(header));
+    const gsize layouts_size = header.layout_count * sizeof(CacheLayout);
+    const gsize keys_size = header.key_count * sizeof(CacheKey);
+    const gsize rows_size = header.row_count * sizeof(guint32);
+    if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.layout_count == 0
+        || length != sizeof(header) + layouts_size + keys_size + rows_size + header.strings_size) {
+        D printf("layout cache invalid\n");
+        return NULL;
+    }
+    const CacheLayout *layouts = (const CacheLayout *) (contents + sizeof(header));
+    const CacheKey *keys = (const CacheKey *) (contents + sizeof(header) + layouts_size);
+    const guint32 *rows = (const guint32 *) (contents + sizeof(header) + layouts_size + keys_size);
+    const gchar *strings = contents + sizeof(header) + layouts_size + keys_size + rows_size;
+    gboolean valid = TRUE;
+    gboolean stale = FALSE;
+    // validate source
+    GStatBuf st;
+    const gchar *cached_suffix = cache_string(strings, header.strings_size, header.suffix, &valid);
+    if (!valid || g_strcmp0(cached_suffix, suffix)) {
+        D printf("layout cache stale\n");
+        return NULL;
+    }
+    if (g_stat(path, &st) != 0) {
+        if (!embedded) {
+            D printf("layout cache stale\n");
+            return NULL;
+        }
+    } else if ((gint64) st.st_mtime != header.mtime || (gint64) st.st_size != header.size) {
+        guint8 hash[CACHE_HASH_LEN];
+        if ((gint64) st.st_size != header.size || !cache_hash(path, hash) || memcmp(hash, header.hash, CACHE_HASH_LEN)) {
+            D printf("layout cache stale\n");
+            return NULL;
+        }
+        stale = TRUE;
+    }
+    gchar *metrics = cache_metrics_id();
+    const gboolean metrics_valid = !g_strcmp0(metrics, cache_string(strings, header.strings_size, header.metrics, &valid));
+    g_free(metrics);
+    stale = stale || !metrics_valid;
+    // build structures
+    Keyboard *root = NULL;
+    guint k = 0;
+    guint r = 0;
+    for (guint l = 0; l < header.layout_count && valid; l++) {
+        const CacheLayout *cl = &layouts[l];
+        if (cl->row_count > header.row_count - r || cl->key_count > header.key_count - k) {
+            valid = FALSE;
+            break;
+        }
+        Keyboard *keyboard = g_malloc0(sizeof(Keyboard));
+        if (root == NULL) {
+            root = keyboard;
+            root->active = root;
+        }
+        keyboard->root = root;
+        root->layouts = g_realloc(root->layouts, (root->layout_count + 1) * sizeof(Keyboard*));
+        root->layouts[root->layout_count++] = keyboard;
+        keyboard->id = g_strdup(cache_string(strings, header.strings_size, cl->id, &valid));
+        keyboard->strings = g_string_chunk_new(KB_STRINGS_CHUNK);
+        keyboard_keys_alloc(keyboard, cl->key_count, cl->row_count);
+        guint row_keys = 0;
+        for (guint i = 0; i < cl->row_count; i++, r++) {
+            keyboard->key_per_row[i] = rows[r];
+            row_keys += rows[r];
+        }
+        if (row_keys != cl->key_count) {
+            valid = FALSE;
+            break;
+        }
+        if (metrics_valid && cl->unit_width) {
+            keyboard->unit_width = cl->unit_width;
+            keyboard->unit_height = cl->unit_height;
+            keyboard->measured = TRUE;
+            keyboard_geometry_invalidate(keyboard);
+        }
+        for (guint i = 0; i < cl->key_count; i++, k++) {
+            const CacheKey *ck = &keys[k];
+            Key *key = &keyboard->keys[i];
+            key->keyboard = keyboard;
+            key->obey_caps = (ck->flags & CACHE_KEY_OBEY_CAPS) != 0;
+            key->fill = (ck->flags & CACHE_KEY_FILL) != 0;
+            key->extended = (ck->flags & CACHE_KEY_EXTENDED) != 0;
+            key->space = (ck->flags & CACHE_KEY_SPACE) != 0;
+            key->repeat = (ck->flags & CACHE_KEY_REPEAT) != 0;
+            key->lock = (ck->flags & CACHE_KEY_LOCK) != 0;
+            key->swipe = (ck->flags & CACHE_KEY_SWIPE) != 0;
+            key->alternates = cache_string_intern(keyboard, cache_string(strings, header.strings_size, ck->alternates, &valid));
+            key->width = ck->width;
+            key->modifier = ck->modifier;
+            for (gint type = 0; type < KBT_COUNT; type++) {
+                key->label[type] = cache_string_intern(keyboard, cache_string(strings, header.strings_size, ck->label[type], &valid));
+                key->image_path[type] = cache_string_intern(keyboard, cache_string(strings, header.strings_size, ck->image_path[type], &valid));
+                key->layout_id[type] = cache_string_intern(keyboard, cache_string(strings, header.strings_size, ck->layout_id[type], &valid));
+                if (ck->action[type] >= KBA_COUNT) {
+                    valid = FALSE;
+                }
+                key->action[type] = (KBaction) ck->action[type];
+                key->keyval[type] = ck->keyval[type];
+                const gchar *sequence = cache_string(strings, header.strings_size, ck->sequence[type], &valid);
+                if (sequence && ck->sequence_len[type] <= strlen(sequence)) {
+                    key->sequence[type] = g_string_chunk_insert_len(keyboard->strings, sequence, ck->sequence_len[type]);
+                    key->sequence_len[type] = ck->sequence_len[type];
+                }
+            }
+        }
+    }
+    if (!valid) {
+        D printf("layout cache invalid\n");
+        keyboard_free(&root);
+        return NULL;
+    }
+    root->cache_stale = stale && !embedded;
+    return root;
+}
+
+/**
+ * Load layouts from binary cache
+ * @param path Layout path
+ * @param suffix Image directory suffix, may be null
+ * @return First layout structure, null if cache is missing or invalid
+ */
+Keyboard * layout_cache_load(const gchar *path, const gchar *suffix) {
+    gchar *cache = cache_path(path, suffix);
+    GMappedFile *mapped = g_mapped_file_new(cache, FALSE, NULL);
+    g_free(cache);
+    if (mapped == NULL) {
+        D printf("layout cache not found\n");
+        return NULL;
+    }
+    Keyboard *keyboard = cache_load(g_mapped_file_get_contents(mapped), g_mapped_file_get_length(mapped),
+                                    path, suffix, FALSE);
+    g_mapped_file_unref(mapped);
+    return keyboard;
+}
+
+/**
+ * Load layouts from cache data compiled into binary (kterm-layout -c).
+ * Data is used if layout file is missing or has the same contents as compiled layout.
+ * @param data Cache data
+ * @param length Cache data length
+ * @param path Layout path
+ * @param suffix Image directory suffix, may be null
+ * @return First layout structure, null if data is invalid or stale
+ */
+Keyboard * layout_cache_load_data(const guint8 *data, gsize length, const gchar *path, const gchar *suffix) {
+    if (GPOINTER_TO_SIZE(data) % sizeof(gint64) == 0) {
+        return cache_load((const gchar *) data, length, path, suffix, TRUE);
+    }
+    // byte array may be unaligned for cache structures
+    gchar *copy = g_malloc(length);
+    memcpy(copy, data, length);
+    Keyboard *keyboard = cache_load(copy, length, path, suffix, TRUE);
+    g_free(copy);
+    return keyboard;
+}
+
+/**
+ * Serialize layouts to binary cache format
+ * @param keyboard First layout structure
+ * @param path Layout path
+ * @param suffix Image directory suffix, may be null
+ * @param length Set to serialized data length
+ * @return Serialized data, null on failure
+ */
+static gchar * cache_serialize(const Keyboard *keyboard, const gchar *path, const gchar *suffix, gsize *length) {
+    GStatBuf st;
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    if (g_stat(path, &st) != 0 || !cache_hash(path, header.hash)) {
+        return NULL;
+    }
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.mtime = (gint64) st.st_mtime;
+    header.size = (gint64) st.st_size;
+    header.layout_count = keyboard->layout_count;
+    GString *strings = g_string_new(NULL);
+    header.suffix = cache_string_add(strings, suffix, suffix ? strlen(suffix) : 0);
+    gchar *metrics = cache_metrics_id();
+    header.metrics = cache_string_add(strings, metrics, strlen(metrics));
+    g_free(metrics);
+    CacheLayout *layouts = g_malloc0(keyboard->layout_count * sizeof(CacheLayout));
+    for (guint l = 0; l < keyboard->layout_count; l++) {
+        header.key_count += keyboard->layouts[l]->key_count;
+        header.row_count += keyboard->layouts[l]->row_count;
+    }
+    CacheKey *keys = g_malloc0(header.key_count * sizeof(CacheKey));
+    guint32 *rows = g_malloc0(header.row_count * sizeof(guint32));
+    guint k = 0;
+    guint r = 0;
+    for (guint l = 0; l < keyboard->layout_count; l++) {
+        const Keyboard *layout = keyboard->layouts[l];
+        CacheLayout *cl = &layouts[l];
+        cl->id = cache_string_add(strings, layout->id, layout->id ? strlen(layout->id) : 0);
+        cl->key_count = layout->key_count;
+        cl->row_count = layout->row_count;
+        for (guint i = 0; i < layout->row_count; i++, r++) {
+            rows[r] = layout->key_per_row[i];
+        }
+        if (layout->widget) {
+            // measured when built
+            cl->unit_width = layout->unit_width;
+            cl->unit_height = layout->unit_height;
+        }
+        for (guint i = 0; i < layout->key_count; i++, k++) {
+            const Key *key = &layout->keys[i];
+            CacheKey *ck = &keys[k];
+            ck->flags = (key->obey_caps ? CACHE_KEY_OBEY_CAPS : 0) | (key->fill ? CACHE_KEY_FILL : 0)
+                        | (key->extended ? CACHE_KEY_EXTENDED : 0) | (key->space ? CACHE_KEY_SPACE : 0)
+                        | (key->repeat ? CACHE_KEY_REPEAT : 0) | (key->lock ? CACHE_KEY_LOCK : 0)
+                        | (key->swipe ? CACHE_KEY_SWIPE : 0);
+            ck->width = key->width;
+            ck->modifier = key->modifier;
+            ck->alternates = cache_string_add(strings, key->alternates, key->alternates ? strlen(key->alternates) : 0);
+            for (gint type = 0; type < KBT_COUNT; type++) {
+                ck->label[type] = cache_string_add(strings, key->label[type], key->label[type] ? strlen(key->label[type]) : 0);
+                ck->image_path[type] = cache_string_add(strings, key->image_path[type],
+                                                        key->image_path[type] ? strlen(key->image_path[type]) : 0);
+                ck->layout_id[type] = cache_string_add(strings, key->layout_id[type],
+                                                       key->layout_id[type] ? strlen(key->layout_id[type]) : 0);
+                ck->action[type] = key->action[type];
+                ck->keyval[type] = key->keyval[type];
+                ck->sequence[type] = cache_string_add(strings, key->sequence[type], key->sequence_len[type]);
+                ck->sequence_len[type] = key->sequence_len[type];
+            }
+        }
+    }
+    header.strings_size = (guint32) strings->len;
+    const gsize layouts_size = header.layout_count * sizeof(CacheLayout);
+    const gsize keys_size = header.key_count * sizeof(CacheKey);
+    const gsize rows_size = header.row_count * sizeof(guint32);
+    *length = sizeof(header) + layouts_size + keys_size + rows_size + strings->len;
+    gchar *contents = g_malloc(*length);
+    memcpy(contents, &header, sizeof(header));
+    memcpy(contents + sizeof(header), layouts, layouts_size);
+    memcpy(contents + sizeof(header) + layouts_size, keys, keys_size);
+    memcpy(contents + sizeof(header) + layouts_size + keys_size, rows, rows_size);
+    memcpy(contents + sizeof(header) + layouts_size + keys_size + rows_size, strings->str, strings->len);
+    g_free(layouts);
+    g_free(keys);
+    g_free(rows);
+    g_string_free(strings, TRUE);
+    return contents;
+}
+
+/**
+ * Save layouts to binary cache
+ * @param keyboard First layout structure
+ * @param path Layout path
+ * @param suffix Image directory suffix, may be null
+ */
+void layout_cache_save(const Keyboard *keyboard, const gchar *path, const gchar *suffix) {
+    gsize length = 0;
+    gchar *contents = cache_serialize(keyboard, path, suffix, &length);
+    if (contents == NULL) {
+        return;
+    }
+    gchar *cache = cache_path(path, suffix);
+    gchar *dir = g_path_get_dirname(cache);
+    GError *error = NULL;
+    if (g_mkdir_with_parents(dir, 0755) == 0) {
+        g_file_set_contents(cache, contents, (gssize) length, &error);
+    }
+    if G_UNLIKELY(error) {
+        D printf("Saving layout cache failed: %s\n", error->message);
+        g_error_free(error);
+    } else {
+        D printf("layout cache saved: %" G_GSIZE_FORMAT " bytes\n", length);
+    }
+    g_free(dir);
+    g_free(cache);
+    g_free(contents);
+}
+
+/**
+ * Write layouts in binary cache format to given file
+ * @param keyboard First layout structure
+ * @param path Layout path
+ * @param suffix Image directory suffix, may be null
+ * @param output Output file path
+ * @param error Set on error, null if success
+ * @return True on success, false otherwise
+ */
+gboolean layout_cache_write(const Keyboard *keyboard, const gchar *path, const gchar *suffix,
+                            const gchar *output, GError **error) {
+    gsize length = 0;
+    gchar *contents = cache_serialize(keyboard, path, suffix, &length);
+    if (contents == NULL) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't serialize layout %s", path);
+        return FALSE;
+    }
+    gboolean ret = g_file_set_contents(output, contents, (gssize) length, error);
+    g_free(contents);
+    return ret;
+}
+
+/**
+ * Write layouts in binary cache format as C source with byte array
+ * @param keyboard First layout structure
+ * @param path Layout path
+ * @param suffix Image directory suffix, may be null
+ * @param output Output file path
+ * @param name Array name
+ * @param error Set on error, null if success
+ * @return True on success, false otherwise
+ */
+gboolean layout_cache_write_c(const Keyboard *keyboard, const gchar *path, const gchar *suffix,
+                              const gchar *output, const gchar *name, GError **error) {
+    gsize length = 0;
+    gchar *contents = cache_serialize(keyboard, path, suffix, &length);
+    if (contents == NULL) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Can't serialize layout %s", path);
+        return FALSE;
+    }
+    GString *source = g_string_sized_new(length * 6 + 256);
+    g_string_append_printf(source, "/* Generated by kterm-layout from %s, do not edit */\n\n", path);
+    g_string_append(source, "#include <glib.h>\n\n");
+    g_string_append_printf(source, "const guint8 %s[] = {", name);
+    for (gsize i = 0; i < length; i++) {
+        g_string_append_printf(source, "%s0x%02x,", (i % 12) ? " " : "\n    ", (guint8) contents[i]);
+    }
+    g_string_append_printf(source, "\n};\n\nconst gsize %s_len = %" G_GSIZE_FORMAT ";\n", name, length);
+    gboolean ret = g_file_set_contents(output, source->str, (gssize) source->len, error);
+    g_string_free(source, TRUE);
+    g_free(contents);
+    return ret;
+}
@@ -0,0 +1,250 @@
+/* layout_reload.c
+ *
+ * This file is part of kterm
+ *
+ * Copyright(C) 2016 Bartek Fabiszewski (www.fabiszewski.net)
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+/*
+ * Layout hot reload.
+ * Layout file and image directories are watched, changed layout is parsed
+ * in a thread and applied to running keyboard. Parser errors keep current layout.
+ */
+
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include "keyboard.h"
+#include "config.h"
+
+/**
+ * Layout reload state
+ */
+struct KBreload {
+    Keyboard *keyboard; /** First layout structure */
+    gchar *path; /** Layout path */
+    const gchar *asset_suffix; /** Image directory suffix, may be null */
+    GFileMonitor *monitor; /** Layout file monitor */
+    GPtrArray *dir_monitors; /** Image directory monitors */
+    GHashTable *images; /** Image paths used by layout */
+    guint source; /** Debounce timer source id, zero if none */
+    GThread *thread; /** Parser thread, null if not running or not applied yet */
+    gboolean pending; /** Files changed while parser was running */
+    Keyboard *parsed; /** Parsed layout, set by parser */
+    GError *error; /** Parser error, set by parser */
+};
+
+static void reload_changed_cb(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                              GFileMonitorEvent event, KBreload *reload);
+
+/**
+ * Start monitoring file or directory
+ * @param path Path
+ * @param directory True for directory monitor
+ * @param reload Reload state
+ * @return File monitor, null on failure
+ */
+static GFileMonitor * reload_monitor_new(const gchar *path, gboolean directory, KBreload *reload) {
+    GError *error = NULL;
+    GFile *file = g_file_new_for_path(path);
+    GFileMonitor *monitor = directory ? g_file_monitor_directory(file, G_FILE_MONITOR_NONE, NULL, &error)
+                                      : g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, &error);
+    g_object_unref(file);
+    if (monitor == NULL) {
+        D printf("Watching %s failed: %s\n", path, error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    g_signal_connect(monitor, "changed", G_CALLBACK(reload_changed_cb), reload);
+    D printf("watching %s\n", path);
+    return monitor;
+}
+
+/**
+ * Watch directories of all images used by layouts.
+ * Called again after each reload, as layout may use other images.
+ * @param reload Reload state
+ */
+static void reload_watch_images(KBreload *reload) {
+    if (reload->dir_monitors) {
+        g_ptr_array_free(reload->dir_monitors, TRUE);
+    }
+    if (reload->images) {
+        g_hash_table_destroy(reload->images);
+    }
+    reload->dir_monitors = g_ptr_array_new_with_free_func(g_object_unref);
+    reload->images = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GHashTable *dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    const Keyboard *keyboard = reload->keyboard;
+    for (guint l = 0; l < keyboard->layout_count; l++) {
+        const Keyboard *layout = keyboard->layouts[l];
+        for (guint i = 0; i < layout->key_count; i++) {
+            const Key *key = &layout->keys[i];
+            for (gint type = 0; type < KBT_COUNT; type++) {
+                const gchar *image_path = key->image_path[type];
+                if (image_path == NULL || g_hash_table_lookup(reload->images, image_path)) { continue; }
+                g_hash_table_insert(reload->images, g_strdup(image_path), GINT_TO_POINTER(1));
+                gchar *dir = g_path_get_dirname(image_path);
+                if (g_hash_table_lookup(dirs, dir)) {
+                    g_free(dir);
+                    continue;
+                }
+                g_hash_table_insert(dirs, dir, GINT_TO_POINTER(1));
+                GFileMonitor *monitor = reload_monitor_new(dir, TRUE, reload);
+                if (monitor) { g_ptr_array_add(reload->dir_monitors, monitor); }
+            }
+        }
+    }
+    g_hash_table_destroy(dirs);
+}
+
+static gboolean reload_apply(gpointer data);
+
+#if GLIB_CHECK_VERSION(2,32,0)
+/**
+ * Parser thread
+ * @param data Reload state
+ * @return Always null
+ */
+static gpointer reload_parse(gpointer data) {
+    KBreload *reload = data;
+    reload->parsed = parse_layout(reload->path, reload->asset_suffix, &reload->error);
+    g_idle_add(reload_apply, reload);
+    return NULL;
+}
+#endif
+
+/**
+ * Debounce timer callback, starts parsing changed layout
+ * @param data Reload state
+ * @return Always false to cancel timeout, as called with g_timeout_add()
+ */
+static gboolean reload_timeout(gpointer data) {
+    KBreload *reload = data;
+    reload->source = 0;
+    if (reload->thread) {
+        reload->pending = TRUE;
+        return FALSE;
+    }
+    D printf("layout changed, reloading %s\n", reload->path);
+#if GLIB_CHECK_VERSION(2,32,0)
+    reload->thread = g_thread_new("kterm-reload", reload_parse, reload);
+#else
+    reload->parsed = parse_layout(reload->path, reload->asset_suffix, &reload->error);
+    reload_apply(reload);
+#endif
+    return FALSE;
+}
+
+/**
+ * Apply parsed layout, called in main loop when parser is done
+ * @param data Reload state
+ * @return Always false to remove source
+ */
+static gboolean reload_apply(gpointer data) {
+    KBreload *reload = data;
+    if (reload->thread) {
+        g_thread_join(reload->thread);
+        reload->thread = NULL;
+    }
+    Keyboard *parsed = reload->parsed;
+    reload->parsed = NULL;
+    if (parsed) {
+        gint64 start = g_get_monotonic_time();
+        keyboard_reload(reload->keyboard, parsed);
+        D printf("Layout reloaded in %" G_GINT64_FORMAT " us\n", g_get_monotonic_time() - start);
+        layout_cache_save(reload->keyboard, reload->path, reload->asset_suffix);
+        reload_watch_images(reload);
+    } else {
+        // keep running layout until file is fixed
+        fprintf(stderr, "Keyboard layout reload failed: %s\n", reload->error->message);
+        g_clear_error(&reload->error);
+    }
+    if (reload->pending) {
+        reload->pending = FALSE;
+        reload->source = g_timeout_add(KB_RELOAD_DEBOUNCE_MS, reload_timeout, reload);
+    }
+    return FALSE;
+}
+
+/**
+ * File monitor changed signal handler.
+ * Changed images are dropped from pixbuf cache, reload is scheduled after
+ * KB_RELOAD_DEBOUNCE_MS without changes, so that editor writes are merged.
+ * @param monitor File monitor
+ * @param file Changed file
+ * @param other_file Unused
+ * @param event Event type
+ * @param reload Reload state
+ */
+static void reload_changed_cb(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                              GFileMonitorEvent event, KBreload *reload) {
+    UNUSED(other_file);
+    if (event == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED) {
+        return;
+    }
+    if (monitor != reload->monitor) {
+        gchar *path = g_file_get_path(file);
+        gboolean used = (path && g_hash_table_lookup(reload->images, path));
+        if (used) { keyboard_pixbuf_forget(path); }
+        g_free(path);
+        if (!used) { return; }
+    }
+    if (reload->source) {
+        g_source_remove(reload->source);
+    }
+    reload->source = g_timeout_add(KB_RELOAD_DEBOUNCE_MS, reload_timeout, reload);
+}
+
+/**
+ * Watch layout file and its images, reload keyboard on changes
+ * @param keyboard First layout structure
+ * @param path Layout path
+ * @param asset_suffix Image directory suffix, may be null
+ * @return Reload state, to be freed with layout_reload_free()
+ */
+KBreload * layout_reload_watch(Keyboard *keyboard, const gchar *path, const gchar *asset_suffix) {
+    KBreload *reload = g_new0(KBreload, 1);
+    reload->keyboard = keyboard;
+    reload->path = g_strdup(path);
+    reload->asset_suffix = asset_suffix;
+    reload->monitor = reload_monitor_new(path, FALSE, reload);
+    reload_watch_images(reload);
+    return reload;
+}
+
+/**
+ * Stop watching layout and free reload state, waits for running parser
+ * @param reload Reload state
+ */
+void layout_reload_free(KBreload *reload) {
+    if (reload == NULL) {
+        return;
+    }
+    if (reload->source) { g_source_remove(reload->source); }
+    if (reload->thread) {
+        g_thread_join(reload->thread);
+        g_idle_remove_by_data(reload);
+    }
+    if (reload->parsed) { keyboard_free(&reload->parsed); }
+    g_clear_error(&reload->error);
+    if (reload->monitor) { g_object_unref(reload->monitor); }
+    g_ptr_array_free(reload->dir_monitors, TRUE);
+    g_hash_table_destroy(reload->images);
+    g_free(reload->path);
+    g_free(reload);
+}
@@ -26,19 +26,16 @@
 #include "config.h"
 
 /**
- * Parse kterm config
- * @return KTconf structure or NULL
+ * Find kterm config path
+ * @param conf_path Buffer for config path, empty string if not found
+ * @param size Buffer size
  */
-KTconf *parse_config(void) {
-    
-    D printf("Parsing config file\n");
-    
-    gchar conf_path[PATH_MAX];
+void config_path(gchar *conf_path, gsize size) {
     conf_path[0] = '\0';
     
     // if kterm config is not found
     if (access(CONFIG_FULL_PATH, R_OK) == 0) {
-        snprintf(conf_path, sizeof(conf_path), "%s", CONFIG_FULL_PATH);
+        snprintf(conf_path, size, "%s", CONFIG_FULL_PATH);
     } else {
         // set path to kterm binary's path
         gchar self[PATH_MAX], *s;
@@ -47,10 +44,22 @@ KTconf *parse_config(void) {
             self[len] = '\0';
             if ((s = strrchr(self, '/')) != NULL) {
                 *s = '\0';
-                snprintf(conf_path, sizeof(conf_path), "%s/%s", self, CONFIG_FILE);
+                snprintf(conf_path, size, "%s/%s", self, CONFIG_FILE);
             }
         }
     }
+}
+
+/**
+ * Parse kterm config
+ * @return KTconf structure or NULL
+ */
+KTconf *parse_config(void) {
+    
+    D printf("Parsing config file\n");
+    
+    gchar conf_path[PATH_MAX];
+    config_path(conf_path, sizeof(conf_path));
     D printf("config: %s\n", conf_path);
     
     KTconf *conf = NULL;
@@ -61,6 +70,11 @@ KTconf *parse_config(void) {
     
     // defaults
     conf->kb_on = 1;
+    conf->kb_slop = KB_SLOP_MM;
+    conf->kb_repeat_delay = KB_REPEAT_DELAY_MS;
+    conf->kb_repeat_interval = KB_REPEAT_INTERVAL_MS;
+    conf->kb_repeat_accel = KB_REPEAT_ACCEL;
+    conf->kb_reload = 0;
     conf->color_reversed = FALSE;
     conf->font_size = VTE_FONT_SIZE;
     snprintf(conf->font_family, sizeof(conf->font_family), "%s", VTE_FONT_FAMILY);
@@ -85,6 +99,78 @@ KTconf *parse_config(void) {
                 D printf("kb_on = %i\n", conf->kb_on);
             }
         }
+        else if (!strncmp(buf, "kb_canvas", 9)) {
+            gint kb_canvas = -1;
+            sscanf(buf, "kb_canvas = %i", &kb_canvas);
+            if (kb_canvas == 0 || kb_canvas == 1) {
+                conf->kb_canvas = kb_canvas;
+                D printf("kb_canvas = %i\n", conf->kb_canvas);
+            }
+        }
+        else if (!strncmp(buf, "kb_slop", 7)) {
+            gint kb_slop = -1;
+            sscanf(buf, "kb_slop = %i", &kb_slop);
+            if (kb_slop >= 0) {
+                conf->kb_slop = (guint) kb_slop;
+                D printf("kb_slop = %u\n", conf->kb_slop);
+            }
+        }
+        else if (!strncmp(buf, "kb_direct", 9)) {
+            gint kb_direct = -1;
+            sscanf(buf, "kb_direct = %i", &kb_direct);
+            if (kb_direct == 0 || kb_direct == 1) {
+                conf->kb_direct = kb_direct;
+                D printf("kb_direct = %i\n", conf->kb_direct);
+            }
+        }
+        else if (!strncmp(buf, "kb_repeat_delay", 15)) {
+            gint kb_repeat_delay = -1;
+            sscanf(buf, "kb_repeat_delay = %i", &kb_repeat_delay);
+            if (kb_repeat_delay >= 0) {
+                conf->kb_repeat_delay = (guint) kb_repeat_delay;
+                D printf("kb_repeat_delay = %u\n", conf->kb_repeat_delay);
+            }
+        }
+        else if (!strncmp(buf, "kb_repeat_interval", 18)) {
+            gint kb_repeat_interval = -1;
+            sscanf(buf, "kb_repeat_interval = %i", &kb_repeat_interval);
+            if (kb_repeat_interval >= 0) {
+                conf->kb_repeat_interval = (guint) kb_repeat_interval;
+                D printf("kb_repeat_interval = %u\n", conf->kb_repeat_interval);
+            }
+        }
+        else if (!strncmp(buf, "kb_repeat_accel", 15)) {
+            gint kb_repeat_accel = -1;
+            sscanf(buf, "kb_repeat_accel = %i", &kb_repeat_accel);
+            if (kb_repeat_accel >= 0 && kb_repeat_accel < 100) {
+                conf->kb_repeat_accel = (guint) kb_repeat_accel;
+                D printf("kb_repeat_accel = %u\n", conf->kb_repeat_accel);
+            }
+        }
+        else if (!strncmp(buf, "kb_reload", 9)) {
+            gint kb_reload = -1;
+            sscanf(buf, "kb_reload = %i", &kb_reload);
+            if (kb_reload == 0 || kb_reload == 1) {
+                conf->kb_reload = kb_reload;
+                D printf("kb_reload = %i\n", conf->kb_reload);
+            }
+        }
+        else if (!strncmp(buf, "kb_suggest_save", 15)) {
+            gint kb_suggest_save = -1;
+            sscanf(buf, "kb_suggest_save = %i", &kb_suggest_save);
+            if (kb_suggest_save == 0 || kb_suggest_save == 1) {
+                conf->kb_suggest_save = kb_suggest_save;
+                D printf("kb_suggest_save = %i\n", conf->kb_suggest_save);
+            }
+        }
+        else if (!strncmp(buf, "kb_suggest", 10)) {
+            gint kb_suggest = -1;
+            sscanf(buf, "kb_suggest = %i", &kb_suggest);
+            if (kb_suggest == 0 || kb_suggest == 1) {
+                conf->kb_suggest = kb_suggest;
+                D printf("kb_suggest = %i\n", conf->kb_suggest);
+            }
+        }
         else if (!strncmp(buf, "color_scheme", 12)) {
             gint color_reversed = -1;
             sscanf(buf, "color_scheme = %i", &color_reversed);
@@ -27,109 +27,184 @@
 /** Global config */
 extern KTconf *conf;
 
+#ifdef KB_EMBEDDED_LAYOUT
+/** Default layout compiled into binary, generated by kterm-layout -c */
+extern const guint8 kterm_layout[];
+/** Default layout data length */
+extern const gsize kterm_layout_len;
+#endif
+
 /** Parser state */
 typedef struct {
+    Keyboard *root; /** First layout structure, owner of all layouts */
     Keyboard *keyboard; /** Keyboard structure to be filled */
-    GtkWidget *container; /** Container widget for keyboard */
-    GtkWidget *current_row; /** Currently parsed row */
-    Key *current_key; /** Currently parsed key */
+    gboolean row_open; /** Row node is being parsed */
+    Key *current_key; /** Currently parsed key, points to key or null */
+    Key key; /** Key being parsed, copied to layout keys array when complete */
+    const gchar *asset_suffix; /** Image directory suffix for screen resolution, null if none */
+    const gchar *path; /** Layout path, base for relative image paths */
+    const gchar *reason; /** Reason of parser failure */
 } State;
 
 /**
- * Lookup table name to keyval
+ * Lookup table keyval to terminal (xterm) input sequence
  */
-static struct kbsymlookup kbspecial[] = {
+static struct kbseqlookup kbsequence[] = {
 #if GTK_CHECK_VERSION(3,0,0)
-    { GDK_KEY_BackSpace, "backspace" },
-    { GDK_KEY_Tab, "tab" },
-    { GDK_KEY_Linefeed, "linefeed" },
-    { GDK_KEY_Clear, "clear" },
-    { GDK_KEY_Return, "return" },
-    { GDK_KEY_Pause, "pause" },
-    { GDK_KEY_Scroll_Lock, "scrolllock" },
-    { GDK_KEY_Sys_Req, "sysreq" },
-    { GDK_KEY_Escape, "escape" },
-    { GDK_KEY_Delete, "delete" },
-    { GDK_KEY_Home, "home" },
-    { GDK_KEY_Left, "left" },
-    { GDK_KEY_Up, "up" },
-    { GDK_KEY_Right, "right" },
-    { GDK_KEY_Down, "down" },
-    { GDK_KEY_Prior, "prior" },
-    { GDK_KEY_Page_Up, "pageup" },
-    { GDK_KEY_Next, "next" },
-    { GDK_KEY_Page_Down, "pagedown" },
-    { GDK_KEY_End, "end" },
-    { GDK_KEY_Begin, "begin" },
-    { GDK_KEY_space, "space" },
-    { GDK_KEY_F1, "f1" },
-    { GDK_KEY_F2, "f2" },
-    { GDK_KEY_F3, "f3" },
-    { GDK_KEY_F4, "f4" },
-    { GDK_KEY_F5, "f5" },
-    { GDK_KEY_F6, "f6" },
-    { GDK_KEY_F7, "f7" },
-    { GDK_KEY_F8, "f8" },
-    { GDK_KEY_F9, "f9" },
-    { GDK_KEY_F10, "f10" },
-    { GDK_KEY_F11, "f11" },
-    { GDK_KEY_F12 , "f12" }
+    { GDK_KEY_BackSpace, "\177" },
+    { GDK_KEY_Tab, "\t" },
+    { GDK_KEY_Linefeed, "\n" },
+    { GDK_KEY_Return, "\r" },
+    { GDK_KEY_Escape, "\033" },
+    { GDK_KEY_Delete, "\033[3~" },
+    { GDK_KEY_Insert, "\033[2~" },
+    { GDK_KEY_Home, "\033[H" },
+    { GDK_KEY_Left, "\033[D" },
+    { GDK_KEY_Up, "\033[A" },
+    { GDK_KEY_Right, "\033[C" },
+    { GDK_KEY_Down, "\033[B" },
+    { GDK_KEY_Page_Up, "\033[5~" },
+    { GDK_KEY_Page_Down, "\033[6~" },
+    { GDK_KEY_End, "\033[F" },
+    { GDK_KEY_Begin, "\033[E" },
+    { GDK_KEY_F1, "\033OP" },
+    { GDK_KEY_F2, "\033OQ" },
+    { GDK_KEY_F3, "\033OR" },
+    { GDK_KEY_F4, "\033OS" },
+    { GDK_KEY_F5, "\033[15~" },
+    { GDK_KEY_F6, "\033[17~" },
+    { GDK_KEY_F7, "\033[18~" },
+    { GDK_KEY_F8, "\033[19~" },
+    { GDK_KEY_F9, "\033[20~" },
+    { GDK_KEY_F10, "\033[21~" },
+    { GDK_KEY_F11, "\033[23~" },
+    { GDK_KEY_F12, "\033[24~" },
+    { GDK_KEY_KP_Enter, "\r" },
+    { GDK_KEY_KP_Tab, "\t" },
+    { GDK_KEY_KP_Delete, "\033[3~" },
+    { GDK_KEY_KP_Insert, "\033[2~" },
+    { GDK_KEY_KP_Home, "\033[H" },
+    { GDK_KEY_KP_Left, "\033[D" },
+    { GDK_KEY_KP_Up, "\033[A" },
+    { GDK_KEY_KP_Right, "\033[C" },
+    { GDK_KEY_KP_Down, "\033[B" },
+    { GDK_KEY_KP_Page_Up, "\033[5~" },
+    { GDK_KEY_KP_Page_Down, "\033[6~" },
+    { GDK_KEY_KP_End, "\033[F" },
+    { GDK_KEY_KP_Begin, "\033[E" }
 #else
-    { GDK_BackSpace, "backspace" },
-    { GDK_Tab, "tab" },
-    { GDK_Linefeed, "linefeed" },
-    { GDK_Clear, "clear" },
-    { GDK_Return, "return" },
-    { GDK_Pause, "pause" },
-    { GDK_Scroll_Lock, "scrolllock" },
-    { GDK_Sys_Req, "sysreq" },
-    { GDK_Escape, "escape" },
-    { GDK_Delete, "delete" },
-    { GDK_Home, "home" },
-    { GDK_Left, "left" },
-    { GDK_Up, "up" },
-    { GDK_Right, "right" },
-    { GDK_Down, "down" },
-    { GDK_Prior, "prior" },
-    { GDK_Page_Up, "pageup" },
-    { GDK_Next, "next" },
-    { GDK_Page_Down, "pagedown" },
-    { GDK_End, "end" },
-    { GDK_Begin, "begin" },
-    { GDK_space, "space" },
-    { GDK_F1, "f1" },
-    { GDK_F2, "f2" },
-    { GDK_F3, "f3" },
-    { GDK_F4, "f4" },
-    { GDK_F5, "f5" },
-    { GDK_F6, "f6" },
-    { GDK_F7, "f7" },
-    { GDK_F8, "f8" },
-    { GDK_F9, "f9" },
-    { GDK_F10, "f10" },
-    { GDK_F11, "f11" },
-    { GDK_F12 , "f12" }
+    { GDK_BackSpace, "\177" },
+    { GDK_Tab, "\t" },
+    { GDK_Linefeed, "\n" },
+    { GDK_Return, "\r" },
+    { GDK_Escape, "\033" },
+    { GDK_Delete, "\033[3~" },
+    { GDK_Insert, "\033[2~" },
+    { GDK_Home, "\033[H" },
+    { GDK_Left, "\033[D" },
+    { GDK_Up, "\033[A" },
+    { GDK_Right, "\033[C" },
+    { GDK_Down, "\033[B" },
+    { GDK_Page_Up, "\033[5~" },
+    { GDK_Page_Down, "\033[6~" },
+    { GDK_End, "\033[F" },
+    { GDK_Begin, "\033[E" },
+    { GDK_F1, "\033OP" },
+    { GDK_F2, "\033OQ" },
+    { GDK_F3, "\033OR" },
+    { GDK_F4, "\033OS" },
+    { GDK_F5, "\033[15~" },
+    { GDK_F6, "\033[17~" },
+    { GDK_F7, "\033[18~" },
+    { GDK_F8, "\033[19~" },
+    { GDK_F9, "\033[20~" },
+    { GDK_F10, "\033[21~" },
+    { GDK_F11, "\033[23~" },
+    { GDK_F12, "\033[24~" },
+    { GDK_KP_Enter, "\r" },
+    { GDK_KP_Tab, "\t" },
+    { GDK_KP_Delete, "\033[3~" },
+    { GDK_KP_Insert, "\033[2~" },
+    { GDK_KP_Home, "\033[H" },
+    { GDK_KP_Left, "\033[D" },
+    { GDK_KP_Up, "\033[A" },
+    { GDK_KP_Right, "\033[C" },
+    { GDK_KP_Down, "\033[B" },
+    { GDK_KP_Page_Up, "\033[5~" },
+    { GDK_KP_Page_Down, "\033[6~" },
+    { GDK_KP_End, "\033[F" },
+    { GDK_KP_Begin, "\033[E" }
 #endif
 };
 
-/** Max size of kbspecial array */
-#define KBSYM_SIZE sizeof(kbspecial)/sizeof(kbspecial[0])
+/** Max size of kbsequence array */
+#define KBSEQ_SIZE sizeof(kbsequence)/sizeof(kbsequence[0])
 
 /**
- * Lookup table name to gdk modifier type
+ * Set parser failure reason
+ * @param state Parser state structure
+ * @param reason Failure reason
+ * @return Always false
  */
-static struct kbmodlookup kbmod[] = {
-    { GDK_SHIFT_MASK, "shift", "Shift_L" },
-    { GDK_LOCK_MASK, "caps", "Caps_Lock" },
-    { GDK_CONTROL_MASK, "ctrl", "Control_L" },
-    { GDK_MOD1_MASK, "alt", "Alt_L" },
-    { GDK_MOD2_MASK, "mod1", "Meta_L" },
-    { GDK_MOD3_MASK, "mod2", "Super_L" },
-    { GDK_MOD4_MASK, "mod3", "Hyper_L" }
-};
+static gboolean parser_fail(State *state, const gchar *reason) {
+    D printf("%s\n", reason);
+    state->reason = reason;
+    return FALSE;
+}
 
-/** Max size of kbmod array */
-#define KBMOD_SIZE sizeof(kbmod)/sizeof(kbmod[0])
+/**
+ * Grow array built while parsing, capacity is doubled when full
+ * @param array Array, may be null
+ * @param count Current elements count
+ * @param size Element size
+ * @return Array with space for at least one more element
+ */
+static gpointer parser_array_grow(gpointer array, guint count, gsize size) {
+    // capacity is max(16, next power of two)
+    if (count == 0 || (count >= 16 && !(count & (count - 1)))) {
+        array = g_realloc(array, MAX(count * 2, 16) * size);
+    }
+    return array;
+}
+
+/**
+ * Add layout to first layout's list of layouts
+ * @param root First layout
+ * @param layout Layout
+ */
+static void parser_layout_add(Keyboard *root, Keyboard *layout) {
+    layout->root = root;
+    root->layouts = g_realloc(root->layouts, (root->layout_count + 1) * sizeof(Keyboard*));
+    root->layouts[root->layout_count++] = layout;
+}
+
+/**
+ * Start new layout, first layout is stored in root structure
+ * @param state Parser state structure
+ * @param attribute_names Attribute names array
+ * @param attribute_values Attribute values array
+ * @return True on success, false otherwise
+ */
+static gboolean parser_layout_start(State *state, const gchar **attribute_names, const gchar **attribute_values) {
+    if (state->row_open || state->current_key) {
+        return parser_fail(state, "Layout inside row");
+    }
+    Keyboard *root = state->root;
+    Keyboard *layout = root;
+    if (root->layout_count) {
+        layout = g_malloc0(sizeof(Keyboard));
+        layout->strings = g_string_chunk_new(KB_STRINGS_CHUNK);
+    }
+    parser_layout_add(root, layout);
+    for (gint j = 0; attribute_names[j]; j++) {
+        if (!g_ascii_strcasecmp(attribute_names[j], "id")) {
+            g_free(layout->id);
+            layout->id = g_strdup(attribute_values[j]);
+        }
+    }
+    state->keyboard = layout;
+    return TRUE;
+}
 
 /** 
  * Start parsing row node
@@ -137,20 +212,13 @@ static struct kbmodlookup kbmod[] = {
  * @return True on success, false otherwise
  */
 static gboolean parser_row_start(State *state) {
-    if (state->keyboard->row_count >= ROWS_MAX) {
-        D printf("Too many rows\n");
-        return FALSE;
-    }
-    if (state->current_row) {
-        D printf("Row not empty\n");
-        return FALSE;
+    if (state->row_open) {
+        return parser_fail(state, "Row not empty");
     }
-#if GTK_CHECK_VERSION(3,0,0)
-    state->current_row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
-#else
-    state->current_row = gtk_hbox_new(FALSE, 0);
-#endif
-    state->keyboard->row_count++;
+    Keyboard *keyboard = state->keyboard;
+    keyboard->key_per_row = parser_array_grow(keyboard->key_per_row, keyboard->row_count, sizeof(guint));
+    keyboard->key_per_row[keyboard->row_count++] = 0;
+    state->row_open = TRUE;
     return TRUE;
 }
 
@@ -160,12 +228,10 @@ static gboolean parser_row_start(State *state) {
  * @return True on success, false otherwise
  */
 static gboolean parser_row_end(State *state) {
-    if (state->current_row == NULL) {
-        D printf("Row empty\n");
-        return FALSE;
+    if (!state->row_open) {
+        return parser_fail(state, "Row empty");
     }
-    gtk_box_pack_start(GTK_BOX(state->container), state->current_row, TRUE, TRUE, 0);
-    state->current_row = NULL;
+    state->row_open = FALSE;
     return TRUE;
 }
 
@@ -178,18 +244,26 @@ static gboolean parser_row_end(State *state) {
  */
 static gboolean parser_button_start(State *state, const gchar **attribute_names, const gchar **attribute_values) {
     if (state->current_key) {
-        D printf("Key not empty\n");
-        return FALSE;
-    }
-    Key *key = g_malloc0(sizeof(Key));
-    if (!key) {
-        D printf("Memory allocation failed\n");
-        return FALSE;
+        return parser_fail(state, "Key not empty");
     }
+    Key *key = &state->key;
+    memset(key, 0, sizeof(Key));
     for (gint j = 0; attribute_names[j]; j++) {
         if (!g_ascii_strcasecmp(attribute_names[j], "obey-caps") && !g_ascii_strcasecmp(attribute_values[j], "true")) {
             key->obey_caps = TRUE;
         }
+        else if (!g_ascii_strcasecmp(attribute_names[j], "repeat") && !g_ascii_strcasecmp(attribute_values[j], "true")) {
+            key->repeat = TRUE;
+        }
+        else if (!g_ascii_strcasecmp(attribute_names[j], "lock") && !g_ascii_strcasecmp(attribute_values[j], "true")) {
+            key->lock = TRUE;
+        }
+        else if (!g_ascii_strcasecmp(attribute_names[j], "swipe") && !g_ascii_strcasecmp(attribute_values[j], "true")) {
+            key->swipe = TRUE;
+        }
+        else if (!g_ascii_strcasecmp(attribute_names[j], "alternates") && attribute_values[j][0]) {
+            key->alternates = g_string_chunk_insert_const(state->keyboard->strings, attribute_values[j]);
+        }
         else if (!g_ascii_strcasecmp(attribute_names[j], "fill") && !g_ascii_strcasecmp(attribute_values[j], "true")) {
             key->fill = TRUE;
         }
@@ -201,9 +275,6 @@ static gboolean parser_button_start(State *state, const gchar **attribute_names,
         }
     }
     key->keyboard = state->keyboard;
-    key->button = gtk_toggle_button_new();
-    gtk_widget_set_name(key->button, "ktermKbButton");
-    gtk_widget_set_can_focus(key->button, FALSE);
     state->current_key = key;
     return TRUE;
 }
@@ -214,15 +285,14 @@ static gboolean parser_button_start(State *state, const gchar **attribute_names,
  * @return True on success, false otherwise
  */
 static gboolean parser_button_end(State *state) {
-    if (state->current_key == NULL) {
-        D printf("Button empty\n");
-        return FALSE;
+    if (state->current_key == NULL || !state->row_open) {
+        return parser_fail(state, "Button empty");
     }
-    gtk_box_pack_start(GTK_BOX(state->current_row), state->current_key->button, FALSE, FALSE, 0);
-    state->keyboard->keys[state->keyboard->key_count++] = state->current_key;
+    Keyboard *keyboard = state->keyboard;
+    keyboard->keys = parser_array_grow(keyboard->keys, keyboard->key_count, sizeof(Key));
+    keyboard->keys[keyboard->key_count++] = *state->current_key;
     state->current_key = NULL;
-    guint row_number = state->keyboard->row_count - 1;
-    state->keyboard->key_per_row[row_number]++;
+    keyboard->key_per_row[keyboard->row_count - 1]++;
     return TRUE;
 }
 
@@ -234,11 +304,11 @@ static gboolean parser_button_end(State *state) {
  * @return True on success, false otherwise
  */
 static gboolean parser_button_space(State *state, const gchar **attribute_names, const gchar **attribute_values) {
-    Key *key = g_malloc0(sizeof(Key));
-    if (!key) {
-        D printf("Memory allocation failed\n");
-        return FALSE;
+    if (state->current_key) {
+        return parser_fail(state, "Key not empty");
     }
+    Key *key = &state->key;
+    memset(key, 0, sizeof(Key));
     for (gint j = 0; attribute_names[j]; j++) {
         if (!g_ascii_strcasecmp(attribute_names[j], "fill") && !g_ascii_strcasecmp(attribute_values[j], "true")) {
             key->fill = TRUE;
@@ -251,11 +321,9 @@ static gboolean parser_button_space(State *state, const gchar **attribute_names,
         }
     }
     key->keyboard = state->keyboard;
-    key->button = gtk_label_new(NULL);
-    gtk_widget_set_can_focus(key->button, FALSE);
+    key->space = TRUE;
     state->current_key = key;
-    parser_button_end(state);
-    return TRUE;
+    return parser_button_end(state);
 }
 
 /**
@@ -263,59 +331,46 @@ static gboolean parser_button_space(State *state, const gchar **attribute_names,
  * @param key Key structure
  * @param attribute_value Display attribute value
  * @param kb_type Layout variant
- * @param width Will be set to minium width of the button
- * @param height Will be set to minium height of the button
+ * @param state Parser state structure
  */
-static void parser_button_label(Key *key, const gchar *attribute_value, const KBtype kb_type, gint *width, gint *height) {
+static void parser_button_label(Key *key, const gchar *attribute_value, const KBtype kb_type, const State *state) {
+    const gchar *asset_suffix = state->asset_suffix;
     const gchar prefix[] = "image:";
     const guint prefix_len = sizeof(prefix) - 1;
-    *width = 0;
-    *height = 0;
+    key->label[kb_type] = NULL;
+    key->image_path[kb_type] = NULL;
     if (!strncmp(attribute_value, prefix, prefix_len)) {
-        GtkWidget *button_image = gtk_image_new();
         gchar path[PATH_MAX];
         if (attribute_value[prefix_len] == '/') {
             // absolute path
             snprintf(path, sizeof(path), "%s", &attribute_value[prefix_len]);
         } else {
             // relative to config
-            snprintf(path, sizeof(path), "%s", conf->kb_conf_path);
+            snprintf(path, sizeof(path), "%s", state->path);
             gchar *p = NULL;
             if ((p = strrchr(path, '/')) != NULL) {
                 *++p = '\0';
-                guint space_left = sizeof(path) - (guint) strlen(path);
-                strncpy(p, &attribute_value[prefix_len], space_left);
             } else {
-                snprintf(path, sizeof(path), "%s", &attribute_value[prefix_len]);
+                p = path;
+                *p = '\0';
             }
-        }
-        gtk_image_set_from_file(GTK_IMAGE(button_image), path);
-        if (kb_type == KBT_DEFAULT) {
-            // initiate default layout
-            g_object_ref(button_image);
-            gtk_button_set_image(GTK_BUTTON(key->button), button_image);
-            gtk_button_set_image_position(GTK_BUTTON(key->button), GTK_POS_BOTTOM);
-        }
-        key->image[kb_type] = button_image;
-        key->label[kb_type] = NULL;
-        if (!key->width) {
-            const GdkPixbuf *pixbuf = gtk_image_get_pixbuf(GTK_IMAGE(button_image));
-            if (pixbuf) {
-                *width = gdk_pixbuf_get_width(pixbuf);
-                *height = gdk_pixbuf_get_height(pixbuf);
+            const gchar *relative = &attribute_value[prefix_len];
+            const gchar *dir_end = strchr(relative, '/');
+            gboolean resolved = FALSE;
+            if (asset_suffix && dir_end) {
+                // try image directory for screen resolution, eg. img-300dpi/ for img/
+                guint space_left = sizeof(path) - (guint) (p - path);
+                snprintf(p, space_left, "%.*s%s%s", (gint) (dir_end - relative), relative, asset_suffix, dir_end);
+                resolved = g_file_test(path, G_FILE_TEST_EXISTS);
+            }
+            if (!resolved) {
+                guint space_left = sizeof(path) - (guint) (p - path);
+                snprintf(p, space_left, "%s", relative);
             }
         }
+        key->image_path[kb_type] = g_string_chunk_insert_const(state->keyboard->strings, path);
     } else {
-        key->label[kb_type] = g_strdup(attribute_value);
-        key->image[kb_type] = NULL;
-        if (kb_type == KBT_DEFAULT) {
-            gtk_button_set_label(GTK_BUTTON(key->button), key->label[kb_type]);
-        }
-        if (!key->width && g_utf8_strlen(key->label[kb_type], -1) == 1) {
-            PangoLayout *layout = gtk_widget_create_pango_layout(key->button, key->label[kb_type]);
-            pango_layout_get_pixel_size(layout, width, height);
-            g_object_unref(layout);
-        }
+        key->label[kb_type] = g_string_chunk_insert_const(state->keyboard->strings, attribute_value);
     }
 }
 
@@ -324,42 +379,126 @@ static void parser_button_label(Key *key, const gchar *attribute_value, const KB
  * @param mod_str Modifier name
  * @return Pointer to Gdk modifier data or NULL
  */
-static const struct kbmodlookup * parser_get_modtype(const gchar *mod_str) {
-    for (guint i = 0; i < KBMOD_SIZE; i++) {
-        if (!g_ascii_strcasecmp(mod_str, kbmod[i].name)) {
-            return &kbmod[i];
-        }
-    }
-    return NULL;
+static const struct kbnamelookup * parser_get_modtype(const gchar *mod_str) {
+    const struct kbnamelookup *mod = kbname_lookup(mod_str, strlen(mod_str));
+    return (mod && mod->modifier) ? mod : NULL;
 }
 
 /**
  * Get keyval for name string
- * @param special Special button name
- * @return Keyval
+ * @param special Special button name or X key symbol name
+ * @return Keyval, zero if not found
  */
 static guint parser_get_keyval(const gchar *special) {
-    for (guint i = 0; i < KBSYM_SIZE; i++) {
-        if (!g_ascii_strcasecmp(special, kbspecial[i].name)) {
-            return kbspecial[i].keyval;
+    const struct kbnamelookup *name = kbname_lookup(special, strlen(special));
+    if (name) {
+        return name->modifier ? 0 : name->keyval;
+    }
+    // any other X key symbol, eg. KP_Enter, XF86AudioPlay
+    guint keyval = gdk_keyval_from_name(special);
+    return (keyval == KB_KEY(VoidSymbol)) ? 0 : keyval;
+}
+
+/**
+ * Set terminal input sequence for key value
+ * @param key Key structure
+ * @param kb_type Layout variant
+ */
+static void parser_button_sequence(Key *key, const KBtype kb_type) {
+    GStringChunk *strings = key->keyboard->strings;
+    key->sequence[kb_type] = NULL;
+    key->sequence_len[kb_type] = 0;
+    const guint keyval = key->keyval[kb_type];
+    if (keyval == 0 || key->modifier) {
+        return;
+    }
+    for (guint i = 0; i < KBSEQ_SIZE; i++) {
+        if (kbsequence[i].keyval == keyval) {
+            key->sequence[kb_type] = g_string_chunk_insert_const(strings, kbsequence[i].sequence);
+            key->sequence_len[kb_type] = (guint) strlen(kbsequence[i].sequence);
+            return;
         }
     }
-    return 0;
+    gunichar uc = gdk_keyval_to_unicode(keyval);
+    if (uc) {
+        gchar utf[7];
+        gint utf_len = g_unichar_to_utf8(uc, utf);
+        utf[utf_len] = '\0';
+        key->sequence[kb_type] = g_string_chunk_insert_const(strings, utf);
+        key->sequence_len[kb_type] = (guint) utf_len;
+    }
+}
+
+/**
+ * Check whether C escapes in string produce null byte (octal escape of zero value), as with g_strcompress()
+ * @param str String with C escapes
+ * @return True if unescaped string contains null byte
+ */
+static gboolean parser_escapes_nul(const gchar *str) {
+    for (const gchar *p = str; *p; p++) {
+        if (*p != '\\') {
+            continue;
+        }
+        p++;
+        guint value = 0;
+        guint digits = 0;
+        while (digits < 3 && p[digits] >= '0' && p[digits] <= '7') {
+            value = value * 8 + (guint) (p[digits++] - '0');
+        }
+        if (digits && value == 0) {
+            return TRUE;
+        }
+        if (*p == '\0') {
+            break;
+        }
+    }
+    return FALSE;
 }
 
 /**
  * Set key button action
+ * @param state Parser state structure
  * @param key Key structure
  * @param attribute_value Action attribute value
  * @param kb_type Layout variant
+ * @return True on success, false otherwise
  */
-static void parser_button_action(Key *key, const gchar *attribute_value, const KBtype kb_type) {
+static gboolean parser_button_action(State *state, Key *key, const gchar *attribute_value, const KBtype kb_type) {
     const gchar prefix[] = "modifier:";
     const guint prefix_len = sizeof(prefix) - 1;
+    const gchar string_prefix[] = "string:";
+    const guint string_prefix_len = sizeof(string_prefix) - 1;
+    const gchar layout_prefix[] = "layout:";
+    const guint layout_prefix_len = sizeof(layout_prefix) - 1;
+    if (!strncmp(attribute_value, layout_prefix, layout_prefix_len)) {
+        // switch to other layout
+        key->action[kb_type] = KBA_LAYOUT;
+        key->keyval[kb_type] = 0;
+        key->layout_id[kb_type] = g_string_chunk_insert_const(key->keyboard->strings, &attribute_value[layout_prefix_len]);
+        return TRUE;
+    }
+    if (!strncmp(attribute_value, string_prefix, string_prefix_len)) {
+        // string written to terminal at once, C escapes allowed
+        const gchar *text = &attribute_value[string_prefix_len];
+        if (*text == '\0') {
+            return parser_fail(state, "Empty string action");
+        }
+        if (parser_escapes_nul(text)) {
+            return parser_fail(state, "Null byte in string action");
+        }
+        key->action[kb_type] = KBA_STRING;
+        key->keyval[kb_type] = 0;
+        gchar *sequence = g_strcompress(text);
+        key->sequence[kb_type] = g_string_chunk_insert_const(key->keyboard->strings, sequence);
+        key->sequence_len[kb_type] = (guint) strlen(sequence);
+        g_free(sequence);
+        return TRUE;
+    }
+    key->action[kb_type] = KBA_KEY;
     if (!strncmp(attribute_value, prefix, prefix_len)) {
-        const struct kbmodlookup *mod = parser_get_modtype(&attribute_value[prefix_len]);
+        const struct kbnamelookup *mod = parser_get_modtype(&attribute_value[prefix_len]);
         if (mod) {
-            key->keyval[kb_type] = gdk_keyval_from_name(mod->gdk_name);
+            key->keyval[kb_type] = mod->keyval;
             key->modifier = mod->modifier;
         } else {
             key->keyval[kb_type] = 0;
@@ -372,6 +511,8 @@ static void parser_button_action(Key *key, const gchar *attribute_value, const K
             key->keyval[kb_type] = parser_get_keyval(attribute_value);
         }
     }
+    parser_button_sequence(key, kb_type);
+    return TRUE;
 }
 
 /**
@@ -384,41 +525,41 @@ static void parser_button_action(Key *key, const gchar *attribute_value, const K
  */
 static gboolean parser_button_contents(State *state, const gchar **attribute_names, const gchar **attribute_values, KBtype kb_type) {
     if (state->current_key == NULL) {
-        D printf("Button empty\n");
-        return FALSE;
+        return parser_fail(state, "Button empty");
     }
     Key *key = state->current_key;
     const gchar *action = NULL;
     for (gint j = 0; attribute_names[j]; j++) {
         if (!g_ascii_strcasecmp(attribute_names[j], "display")) {
-            gint width = 0;
-            gint height = 0;
-            parser_button_label(key, attribute_values[j], kb_type, &width, &height);
-            D printf("key width: %i\n", width);
-            if ((guint) width > state->keyboard->unit_width) {
-                state->keyboard->unit_width = (guint) width;
-            }
-            if ((guint) height > state->keyboard->unit_height) {
-                state->keyboard->unit_height = (guint) height;
-            }
+            parser_button_label(key, attribute_values[j], kb_type, state);
         }
         else if (!g_ascii_strcasecmp(attribute_names[j], "action")) {
             action = attribute_values[j];
         }
     }
     if (action) {
-        parser_button_action(key, action, kb_type);
+        return parser_button_action(state, key, action, kb_type);
     } else if (key->label[kb_type]) {
-        parser_button_action(key, key->label[kb_type], kb_type);
-    }
-    if (kb_type == KBT_DEFAULT) {
-        g_signal_connect(key->button, "button-press-event", G_CALLBACK(keyboard_event), key);
-        g_signal_connect(key->button, "button-release-event", G_CALLBACK(keyboard_event), key);
+        return parser_button_action(state, key, key->label[kb_type], kb_type);
     }
-
     return TRUE;
 }
 
+/**
+ * Set parser error with position of failing node
+ * @param context Parser internal context
+ * @param state Parser state structure
+ * @param error Set to parser error
+ */
+static void parser_set_error(GMarkupParseContext *context, const State *state, GError **error) {
+    gint line = 0;
+    gint column = 0;
+    g_markup_parse_context_get_position(context, &line, &column);
+    g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                "Line %i, column %i: Not a valid kterm keyboard layout: %s",
+                line, column, state->reason ? state->reason : "unknown error");
+}
+
 /**
  * Parser start node callback
  * @param context Parser internal context
@@ -431,13 +572,15 @@ static gboolean parser_button_contents(State *state, const gchar **attribute_nam
 static void parser_start_node_cb(GMarkupParseContext *context, const gchar *node_name,
                                  const gchar **attribute_names, const gchar **attribute_values,
                                  gpointer user_data, GError **error) {
-    UNUSED(context);
     gboolean ret = TRUE;
     State *state = user_data;
     for (gint i = 0; attribute_names[i]; i++) {
         D printf ("attribute %s = \"%s\"\n", attribute_names[i], attribute_values[i]);
     }
-    if (!strcmp(node_name, "row")) {
+    if (!strcmp(node_name, "layout")) {
+        ret = parser_layout_start(state, attribute_names, attribute_values);
+    }
+    else if (!strcmp(node_name, "row")) {
         ret = parser_row_start(state);
     }
     else if (!strcmp(node_name, "key")) {
@@ -462,7 +605,7 @@ static void parser_start_node_cb(GMarkupParseContext *context, const gchar *node
         ret = parser_button_space(state, attribute_names, attribute_values);
     }
     if (ret == FALSE) {
-        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE, "Not a valid kterm keyboard layout");
+        parser_set_error(context, state, error);
     }
 }
 
@@ -475,7 +618,6 @@ static void parser_start_node_cb(GMarkupParseContext *context, const gchar *node
  */
 static void parser_end_node_cb(GMarkupParseContext *context, const gchar *node_name,
                                gpointer user_data, GError **error) {
-    UNUSED(context);
     gboolean ret = TRUE;
     State *state = user_data;
     D printf("end name: %s\n", node_name);
@@ -486,95 +628,242 @@ static void parser_end_node_cb(GMarkupParseContext *context, const gchar *node_n
         ret = parser_button_end(state);
     }
     if (ret == FALSE) {
-        g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE, "Not a valid kterm keyboard layout");
+        parser_set_error(context, state, error);
     }
 }
 
 /**
- * Recursively free state structure
- * @param state Parser state
+ * Check whether key face differs between two display states
+ * @param key Key structure
+ * @param state_a First display state
+ * @param state_b Second display state
+ * @return True if key label/image differs, false otherwise
  */
-static void state_cleanup(State *state) {
-    if (state) {
-        if (state->current_row) { gtk_widget_destroy(state->current_row); }
-        if (state->current_key) { keyboard_key_free(state->current_key); }
+static gboolean parser_key_differs(const Key *key, guint state_a, guint state_b) {
+    KBtype a = keyboard_key_face(key, state_a);
+    KBtype b = keyboard_key_face(key, state_b);
+    if (a == b) {
+        return FALSE;
     }
+    if (key->image_path[a] || key->image_path[b]) {
+        return g_strcmp0(key->image_path[a], key->image_path[b]) != 0;
+    }
+    return g_strcmp0(key->label[a], key->label[b]) != 0;
 }
 
 /**
- * Parse keyboard config and build initial layout
- * @param parent Parent widget for keyboard widget
+ * Precompute lists of keys which differ between each pair of display states
+ * @param keyboard Keyboard structure
+ */
+static void parser_layout_diff(Keyboard *keyboard) {
+    for (guint a = 0; a < KB_STATES; a++) {
+        for (guint b = 0; b < KB_STATES; b++) {
+            if (a == b) { continue; }
+            guint count = 0;
+            for (guint i = 0; i < keyboard->key_count; i++) {
+                if (parser_key_differs(&keyboard->keys[i], a, b)) { count++; }
+            }
+            if (count == 0) { continue; }
+            Key **diff = g_malloc(count * sizeof(Key*));
+            count = 0;
+            for (guint i = 0; i < keyboard->key_count; i++) {
+                if (parser_key_differs(&keyboard->keys[i], a, b)) { diff[count++] = &keyboard->keys[i]; }
+            }
+            keyboard->layout_diff[a][b] = diff;
+            keyboard->layout_diff_count[a][b] = count;
+            D printf("layout diff %u -> %u: %u keys\n", a, b, count);
+        }
+    }
+    keyboard->layout_state = KBT_DEFAULT;
+}
+
+/**
+ * Build index of modifier keys for each modifier bit
+ * @param keyboard Keyboard structure
+ */
+static void parser_layout_modifiers(Keyboard *keyboard) {
+    for (guint bit = 0; bit < KB_MODIFIER_BITS; bit++) {
+        const guint32 modifier = 1U << bit;
+        guint count = 0;
+        for (guint i = 0; i < keyboard->key_count; i++) {
+            if (keyboard->keys[i].modifier == modifier) { count++; }
+        }
+        if (count == 0) { continue; }
+        Key **keys = g_malloc(count * sizeof(Key*));
+        count = 0;
+        for (guint i = 0; i < keyboard->key_count; i++) {
+            if (keyboard->keys[i].modifier == modifier) { keys[count++] = &keyboard->keys[i]; }
+        }
+        keyboard->modifier_keys[bit] = keys;
+        keyboard->modifier_key_count[bit] = count;
+        D printf("modifier %u: %u keys\n", modifier, count);
+    }
+}
+
+/**
+ * Move parsed keys and rows to single block owned by layout
+ * @param keyboard Keyboard structure
+ */
+static void parser_layout_pack(Keyboard *keyboard) {
+    Key *keys = keyboard->keys;
+    guint *rows = keyboard->key_per_row;
+    keyboard_keys_alloc(keyboard, keyboard->key_count, keyboard->row_count);
+    if (keyboard->key_count) {
+        memcpy(keyboard->keys, keys, keyboard->key_count * sizeof(Key));
+    }
+    if (keyboard->row_count) {
+        memcpy(keyboard->key_per_row, rows, keyboard->row_count * sizeof(guint));
+    }
+    g_free(keys);
+    g_free(rows);
+}
+
+/**
+ * Get image directory suffix matching screen resolution
+ * @param dpi Screen resolution
+ * @return Suffix, null for default resolution
+ */
+const gchar * layout_asset_suffix(gdouble dpi) {
+    if (dpi > KB_DPI_HIGH) {
+        return "-300dpi";
+    } else if (dpi > KB_DPI_MEDIUM) {
+        return "-200dpi";
+    }
+    return NULL;
+}
+
+/**
+ * Get physical screen resolution for choosing images.
+ * Font resolution (Xft.dpi) is usually 96 regardless of screen, so it is used only if physical size is unknown.
+ * @return Resolution in dpi, zero if unknown
+ */
+static gdouble parser_screen_dpi(void) {
+    GdkScreen *screen = gdk_screen_get_default();
+    gdouble dpi = 0;
+    if (gdk_screen_get_width_mm(screen) > 0) {
+        dpi = gdk_screen_get_width(screen) / (gdk_screen_get_width_mm(screen) * MM_TO_IN);
+    } else {
+        dpi = gdk_screen_get_resolution(screen);
+    }
+    D printf("Screen resolution: %i dpi\n", (gint) dpi);
+    return dpi;
+}
+
+/**
+ * Parse keyboard layout file without building widgets
+ * @param path Layout file path
+ * @param asset_suffix Image directory suffix for screen resolution, may be null
  * @param error Set on error, null if success
  * @return Keyboard structure, null on failure
  */
-Keyboard * build_layout(GtkWidget *parent, GError **error) {
-    FILE *fp = NULL;
-    if (getenv("MB_KBD_CONFIG")) {
-        // override path with env variable
-        gchar kb_env_path[PATH_MAX];
-        snprintf(kb_env_path, sizeof(kb_env_path), "%s", getenv("MB_KBD_CONFIG"));
-        fp = fopen(kb_env_path, "r");
-    }
-    if (fp) {
-        snprintf(conf->kb_conf_path, sizeof(conf->kb_conf_path), "%s", getenv("MB_KBD_CONFIG"));
-        D printf("Layout path from MB_KBD_CONFIG: %s\n", getenv("MB_KBD_CONFIG"));
-    } else if ((fp = fopen(conf->kb_conf_path, "r")) != NULL) {
-        D printf("Layout path from config: %s\n", conf->kb_conf_path);
-    } else {
-        D printf("No layout config\n");
+Keyboard * parse_layout(const gchar *path, const gchar *asset_suffix, GError **error) {
+    gchar *contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(path, &contents, &length, error)) {
         return NULL;
     }
-
     State state;
     memset(&state, 0, sizeof(State));
+    state.asset_suffix = asset_suffix;
+    state.path = path;
     Keyboard *keyboard = g_malloc0(sizeof(Keyboard));
-    if (!keyboard) {
-        D printf("Memory allocation failed\n");
-        fclose(fp);
-        return NULL;
-    }
+    state.root = keyboard;
     state.keyboard = keyboard;
-    Key **keys = g_malloc0(KEYS_MAX * sizeof(Key*));
-    if (!keys) {
-        D printf("Memory allocation failed\n");
-        fclose(fp);
-        g_free(keyboard);
-        return NULL;
-    }
-    keyboard->keys = keys;
-    state.container = parent;
+    keyboard->root = keyboard;
+    keyboard->active = keyboard;
+    keyboard->strings = g_string_chunk_new(KB_STRINGS_CHUNK);
     GMarkupParser parser;
     memset(&parser, 0, sizeof(GMarkupParser));
     parser.start_element = parser_start_node_cb;
     parser.end_element = parser_end_node_cb;
     GMarkupParseContext *context = g_markup_parse_context_new(&parser, 0, &state, NULL);
-    if G_UNLIKELY(!context) {
-        D printf("g_markup_parse_context_new failed\n");
-        fclose(fp);
+    if (g_markup_parse_context_parse(context, contents, (gssize) length, error)) {
+        g_markup_parse_context_end_parse(context, error);
+    }
+    g_markup_parse_context_free(context);
+    g_free(contents);
+    if (keyboard->layout_count == 0) {
+        // no layout node
+        parser_layout_add(keyboard, keyboard);
+    }
+    D printf("Parsed %d layouts, first with %d keys in %d rows\n", keyboard->layout_count, keyboard->key_count, keyboard->row_count);
+    for (guint i = 0; i < keyboard->layout_count; i++) {
+        parser_layout_pack(keyboard->layouts[i]);
+    }
+    if G_UNLIKELY(*error) {
         keyboard_free(&keyboard);
-        state_cleanup(&state);
         return NULL;
     }
-    gchar buf[500];
-    while (fgets(buf, sizeof(buf), fp)) {
-        g_markup_parse_context_parse(context, buf, (gssize) strlen(buf), error);
-        if (keyboard->key_count + KBT_COUNT >= KEYS_MAX) {
-            g_set_error(error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE, "Too many keys (max %i)", KEYS_MAX);
+    for (guint i = 0; i < keyboard->layout_count; i++) {
+        parser_layout_diff(keyboard->layouts[i]);
+        parser_layout_modifiers(keyboard->layouts[i]);
+    }
+    return keyboard;
+}
+
+/**
+ * Parse keyboard config and build keyboard widgets
+ * @param parent Parent widget for keyboard widget
+ * @param error Set on error, null if success
+ * @return Keyboard structure, null on failure
+ */
+Keyboard * build_layout(GtkWidget *parent, GError **error) {
+    const gchar *env_path = getenv("MB_KBD_CONFIG");
+    if (env_path && g_file_test(env_path, G_FILE_TEST_IS_REGULAR)) {
+        // override path with env variable
+        snprintf(conf->kb_conf_path, sizeof(conf->kb_conf_path), "%s", env_path);
+        D printf("Layout path from MB_KBD_CONFIG: %s\n", env_path);
+    } else if (g_file_test(conf->kb_conf_path, G_FILE_TEST_IS_REGULAR)) {
+        D printf("Layout path from config: %s\n", conf->kb_conf_path);
+#ifdef KB_EMBEDDED_LAYOUT
+    } else if (!strcmp(conf->kb_conf_path, KB_FULL_PATH)) {
+        D printf("Default layout file missing, trying embedded layout\n");
+#endif
+    } else {
+        D printf("No layout config\n");
+        return NULL;
+    }
+
+    const gchar *asset_suffix = layout_asset_suffix(parser_screen_dpi());
+    gint64 start = g_get_monotonic_time();
+    Keyboard *keyboard = NULL;
+#ifdef KB_EMBEDDED_LAYOUT
+    if (!strcmp(conf->kb_conf_path, KB_FULL_PATH)) {
+        keyboard = layout_cache_load_data(kterm_layout, kterm_layout_len, conf->kb_conf_path, asset_suffix);
+        if (keyboard) { D printf("Using embedded layout\n"); }
+    }
+#endif
+    if (keyboard == NULL) {
+        keyboard = layout_cache_load(conf->kb_conf_path, asset_suffix);
+    }
+    if (keyboard) {
+        for (guint i = 0; i < keyboard->layout_count; i++) {
+            parser_layout_diff(keyboard->layouts[i]);
+            parser_layout_modifiers(keyboard->layouts[i]);
+        }
+        D printf("Layout loaded from cache in %" G_GINT64_FORMAT " us\n", g_get_monotonic_time() - start);
+        keyboard_build(keyboard, parent);
+        D printf("Layout built in %" G_GINT64_FORMAT " us\n", g_get_monotonic_time() - start);
+        if (keyboard->cache_stale) {
+            // file time or metrics changed, save them so that next launch does not hash or measure again
+            layout_cache_save(keyboard, conf->kb_conf_path, asset_suffix);
+            keyboard->cache_stale = FALSE;
         }
-        if G_UNLIKELY(*error) { break; }
+        if (conf->kb_reload) { keyboard->reload = layout_reload_watch(keyboard, conf->kb_conf_path, asset_suffix); }
+        return keyboard;
     }
-    g_markup_parse_context_free(context);
-    D printf("Parsed %d keys in %d rows\n", keyboard->key_count, keyboard->row_count);
-    if G_UNLIKELY(*error){
+
+    keyboard = parse_layout(conf->kb_conf_path, asset_suffix, error);
+    if G_UNLIKELY(!keyboard) {
         g_prefix_error(error, "Keyboard layout parser error.\n");
         D printf("%s\n", (*error)->message);
-        keyboard_free(&keyboard);
-    } else {
-        keyboard->keys = g_realloc(keyboard->keys, keyboard->key_count * sizeof(Key*));
-        keyboard->container = state.container;
+        return NULL;
     }
-    fclose(fp);
-    state_cleanup(&state);
-    
+    D printf("Layout parsed in %" G_GINT64_FORMAT " us\n", g_get_monotonic_time() - start);
+    // other layouts are built on first use
+    keyboard_build(keyboard, parent);
+    D printf("Layout built in %" G_GINT64_FORMAT " us\n", g_get_monotonic_time() - start);
+    layout_cache_save(keyboard, conf->kb_conf_path, asset_suffix);
+    if (conf->kb_reload) { keyboard->reload = layout_reload_watch(keyboard, conf->kb_conf_path, asset_suffix); }
     return keyboard;
 }
@@ -0,0 +1,673 @@
+/* suggest.c
+ *
+ * This file is part of kterm
+ *
+ * Copyright(C) 2016 Bartek Fabiszewski (www.fabiszewski.net)
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+/*
+ * Suggestion strip.
+ * Words from shell history and from input typed in terminal are kept
+ * in a prefix trie, ranked by use count. Word being typed is completed
+ * with most used words sharing its prefix.
+ */
+
+#include <gtk/gtk.h>
+#include <vte/vte.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "suggest.h"
+#include "config.h"
+
+#ifndef VTE_CHECK_VERSION
+#define VTE_CHECK_VERSION(x,y,z) FALSE
+#endif
+
+/** Global config */
+extern KTconf *conf;
+
+/** Index file magic */
+#define SUGGEST_MAGIC 0x4b545331
+/** Index file format version, change invalidates saved index */
+#define SUGGEST_VERSION 1
+/** Max count of history files */
+#define SUGGEST_SOURCES_MAX 4
+
+/**
+ * Trie node, stored in single array, root is first node
+ */
+typedef struct {
+    guint32 child; /** First child index, zero if none */
+    guint32 sibling; /** Next sibling index, zero if none */
+    guint32 count; /** Count of words ending at node */
+    guint32 best; /** Highest count of words in subtree, including node */
+    guint32 byte; /** Byte on edge from parent */
+} SuggestNode;
+
+/**
+ * Indexed history file
+ */
+typedef struct {
+    guint32 hash; /** Path hash */
+    guint32 reserved; /** Padding */
+    gint64 offset; /** Size of indexed part */
+} SuggestSource;
+
+/**
+ * Index file header
+ */
+typedef struct {
+    guint32 magic; /** File magic */
+    guint32 version; /** Format version */
+    guint32 node_count; /** Trie nodes count */
+    guint32 source_count; /** History files count */
+    SuggestSource sources[SUGGEST_SOURCES_MAX]; /** Indexed history files */
+} SuggestHeader;
+
+/**
+ * Suggestion candidate
+ */
+typedef struct {
+    gchar word[SUGGEST_WORD_MAX]; /** Word */
+    guint32 count; /** Use count, zero if empty */
+} SuggestCandidate;
+
+/**
+ * Suggestion strip state
+ */
+struct KTsuggest {
+    GArray *nodes; /** Trie nodes */
+    SuggestSource sources[SUGGEST_SOURCES_MAX]; /** Indexed history files */
+    guint source_count; /** History files count */
+    gboolean dirty; /** Index changed since loaded */
+    VteTerminal *terminal; /** Terminal */
+    GtkWidget *widget; /** Strip widget */
+    GtkWidget *buttons[SUGGEST_COUNT]; /** Suggestion buttons */
+    SuggestCandidate candidates[SUGGEST_COUNT]; /** Shown suggestions, best first */
+    gchar word[SUGGEST_WORD_MAX]; /** Word being typed */
+    gsize word_len; /** Length of word being typed */
+    gboolean escape; /** Inside terminal escape sequence */
+    guint index_source; /** History indexing idle source id, zero if none */
+    gchar **index_paths; /** History files being indexed, null if indexing is not running */
+    guint index_path; /** Position of history file being indexed in index_paths */
+};
+
+/**
+ * Get index file path
+ * @return Path, to be freed with g_free()
+ */
+static gchar * suggest_index_path(void) {
+    return g_build_filename(g_get_user_cache_dir(), "kterm", "suggest.idx", NULL);
+}
+
+/**
+ * Clear trie, leaving only root node
+ * @param suggest Suggest state
+ */
+static void suggest_clear(KTsuggest *suggest) {
+    SuggestNode root = { 0 };
+    g_array_set_size(suggest->nodes, 0);
+    g_array_append_val(suggest->nodes, root);
+    suggest->dirty = TRUE;
+}
+
+/**
+ * Add word to trie or increase its count
+ * @param suggest Suggest state
+ * @param word Word
+ * @param len Word length
+ * @return True on success, false if trie is full
+ */
+static gboolean suggest_insert(KTsuggest *suggest, const gchar *word, gsize len) {
+    guint32 path[SUGGEST_WORD_MAX];
+    guint32 node = 0;
+    if (len >= SUGGEST_WORD_MAX) {
+        return FALSE;
+    }
+    for (gsize i = 0; i < len; i++) {
+        const guint32 byte = (guchar) word[i];
+        guint32 child = g_array_index(suggest->nodes, SuggestNode, node).child;
+        while (child && g_array_index(suggest->nodes, SuggestNode, child).byte != byte) {
+            child = g_array_index(suggest->nodes, SuggestNode, child).sibling;
+        }
+        if (child == 0) {
+            if (suggest->nodes->len >= SUGGEST_NODES_MAX) {
+                return FALSE;
+            }
+            SuggestNode new_node = { 0 };
+            new_node.byte = byte;
+            new_node.sibling = g_array_index(suggest->nodes, SuggestNode, node).child;
+            child = suggest->nodes->len;
+            g_array_append_val(suggest->nodes, new_node);
+            g_array_index(suggest->nodes, SuggestNode, node).child = child;
+        }
+        path[i] = child;
+        node = child;
+    }
+    SuggestNode *end = &g_array_index(suggest->nodes, SuggestNode, node);
+    if (end->count < G_MAXUINT32) { end->count++; }
+    const guint32 count = end->count;
+    for (gsize i = 0; i < len; i++) {
+        SuggestNode *p = &g_array_index(suggest->nodes, SuggestNode, path[i]);
+        if (p->best < count) { p->best = count; }
+    }
+    suggest->dirty = TRUE;
+    return TRUE;
+}
+
+/**
+ * Add all words of text to trie
+ * @param suggest Suggest state
+ * @param text Text
+ * @param len Text length
+ * @return Count of added words
+ */
+static guint suggest_insert_text(KTsuggest *suggest, const gchar *text, gsize len) {
+    guint added = 0;
+    gsize start = 0;
+    for (gsize i = 0; i <= len; i++) {
+        if (i < len && !g_ascii_isspace(text[i])) {
+            continue;
+        }
+        const gsize word_len = i - start;
+        if (word_len >= SUGGEST_WORD_MIN && word_len < SUGGEST_WORD_MAX
+            && g_utf8_validate(text + start, (gssize) word_len, NULL)
+            && suggest_insert(suggest, text + start, word_len)) {
+            added++;
+        }
+        start = i + 1;
+    }
+    return added;
+}
+
+/**
+ * Keep candidate if it ranks among best ones
+ * @param top Candidates, best first
+ * @param word Word
+ * @param len Word length
+ * @param count Word use count
+ */
+static void suggest_rank(SuggestCandidate *top, const gchar *word, gsize len, guint32 count) {
+    gint i = SUGGEST_COUNT - 1;
+    if (count <= top[i].count) {
+        return;
+    }
+    for (; i > 0 && top[i - 1].count < count; i--) {
+        top[i] = top[i - 1];
+    }
+    memcpy(top[i].word, word, len);
+    top[i].word[len] = '\0';
+    top[i].count = count;
+}
+
+/**
+ * Collect most used words below trie node.
+ * Subtrees with no word better than worst candidate are skipped.
+ * @param suggest Suggest state
+ * @param node Node index
+ * @param buf Word buffer, filled up to depth
+ * @param depth Node depth
+ * @param top Candidates, best first
+ * @param budget Count of nodes left to visit
+ */
+static void suggest_collect(const KTsuggest *suggest, guint32 node, gchar *buf, gsize depth,
+                            SuggestCandidate *top, guint *budget) {
+    if (depth + 1 >= SUGGEST_WORD_MAX) {
+        return;
+    }
+    guint32 child = g_array_index(suggest->nodes, SuggestNode, node).child;
+    for (; child && *budget; child = g_array_index(suggest->nodes, SuggestNode, child).sibling) {
+        const SuggestNode *p = &g_array_index(suggest->nodes, SuggestNode, child);
+        (*budget)--;
+        if (p->best <= top[SUGGEST_COUNT - 1].count) {
+            continue;
+        }
+        buf[depth] = (gchar) p->byte;
+        if (p->count) {
+            suggest_rank(top, buf, depth + 1, p->count);
+        }
+        suggest_collect(suggest, child, buf, depth + 1, top, budget);
+    }
+}
+
+/**
+ * Find most used words starting with prefix.
+ * Count of visited nodes is limited by SUGGEST_VISIT_MAX, so lookup time is bounded.
+ * @param suggest Suggest state
+ * @param prefix Prefix
+ * @param len Prefix length
+ * @param top Candidates to fill, best first, unused have zero count
+ */
+static void suggest_lookup(const KTsuggest *suggest, const gchar *prefix, gsize len, SuggestCandidate *top) {
+    memset(top, 0, sizeof(SuggestCandidate) * SUGGEST_COUNT);
+    guint32 node = 0;
+    for (gsize i = 0; i < len; i++) {
+        guint32 child = g_array_index(suggest->nodes, SuggestNode, node).child;
+        while (child && g_array_index(suggest->nodes, SuggestNode, child).byte != (guchar) prefix[i]) {
+            child = g_array_index(suggest->nodes, SuggestNode, child).sibling;
+        }
+        if (child == 0) {
+            return;
+        }
+        node = child;
+    }
+    gchar buf[SUGGEST_WORD_MAX];
+    memcpy(buf, prefix, len);
+    guint budget = SUGGEST_VISIT_MAX;
+    suggest_collect(suggest, node, buf, len, top, &budget);
+}
+
+/**
+ * Update suggestion buttons for word being typed
+ * @param suggest Suggest state
+ */
+static void suggest_update(KTsuggest *suggest) {
+    gint64 start = g_get_monotonic_time();
+    if (suggest->word_len >= SUGGEST_PREFIX_MIN && !suggest->escape) {
+        suggest_lookup(suggest, suggest->word, suggest->word_len, suggest->candidates);
+    } else {
+        memset(suggest->candidates, 0, sizeof(suggest->candidates));
+    }
+    for (guint i = 0; i < SUGGEST_COUNT; i++) {
+        const SuggestCandidate *candidate = &suggest->candidates[i];
+        const gchar *label = candidate->count ? candidate->word : "";
+        if (strcmp(label, gtk_button_get_label(GTK_BUTTON(suggest->buttons[i])))) {
+            gtk_button_set_label(GTK_BUTTON(suggest->buttons[i]), label);
+        }
+        gtk_widget_set_sensitive(suggest->buttons[i], candidate->count != 0);
+    }
+    D printf("suggestions updated in %" G_GINT64_FORMAT " us\n", g_get_monotonic_time() - start);
+}
+
+/**
+ * Word typed in terminal is complete, add it to trie
+ * @param suggest Suggest state
+ */
+static void suggest_word_end(KTsuggest *suggest) {
+    if (suggest->word_len) {
+        suggest_insert_text(suggest, suggest->word, suggest->word_len);
+        suggest->word_len = 0;
+    }
+}
+
+/**
+ * Check whether terminal child reads secret input, eg. at password prompt.
+ * Line editors (readline, zle, ash lineedit) also turn echo off, but they
+ * read in raw mode and echo themselves; password prompts read whole lines
+ * in canonical mode with echo off.
+ * @param terminal Terminal
+ * @return True if echo is off in canonical mode
+ */
+static gboolean suggest_input_secret(VteTerminal *terminal) {
+#if VTE_CHECK_VERSION(0,38,0)
+    VtePty *pty = vte_terminal_get_pty(terminal);
+    const gint fd = pty ? vte_pty_get_fd(pty) : -1;
+#elif VTE_CHECK_VERSION(0,26,0)
+    VtePty *pty = vte_terminal_get_pty_object(terminal);
+    const gint fd = pty ? vte_pty_get_fd(pty) : -1;
+#else
+    const gint fd = vte_terminal_get_pty(terminal);
+#endif
+    struct termios tio;
+    return (fd >= 0 && tcgetattr(fd, &tio) == 0 && !(tio.c_lflag & ECHO) && (tio.c_lflag & ICANON));
+}
+
+/**
+ * Terminal commit signal handler, tracks word being typed.
+ * Input typed at password prompts is not tracked.
+ * @param terminal Terminal
+ * @param text Text sent to terminal child
+ * @param size Text size
+ * @param suggest Suggest state
+ */
+static void suggest_commit_cb(VteTerminal *terminal, gchar *text, guint size, KTsuggest *suggest) {
+    if (suggest_input_secret(terminal)) {
+        suggest->word_len = 0;
+        suggest_update(suggest);
+        return;
+    }
+    for (guint i = 0; i < size; i++) {
+        const guchar c = (guchar) text[i];
+        if (suggest->escape) {
+            // sequence ends with final byte, CSI and SS3 introducers excluded
+            if (c >= 0x40 && c <= 0x7e && c != '[' && c != 'O') { suggest->escape = FALSE; }
+        } else if (c == 0x1b) {
+            suggest->escape = TRUE;
+            suggest->word_len = 0;
+        } else if (c == 0x7f || c == '\b') {
+            // remove whole utf-8 character
+            while (suggest->word_len && (suggest->word[--suggest->word_len] & 0xc0) == 0x80) {}
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            suggest_word_end(suggest);
+        } else if (c < 0x20) {
+            suggest->word_len = 0;
+        } else if (suggest->word_len < SUGGEST_WORD_MAX - 1) {
+            suggest->word[suggest->word_len++] = (gchar) c;
+        }
+    }
+    suggest_update(suggest);
+}
+
+/**
+ * Suggestion button clicked signal handler, sends rest of suggested word in one write
+ * @param button Button
+ * @param suggest Suggest state
+ */
+static void suggest_clicked_cb(GtkWidget *button, KTsuggest *suggest) {
+    for (guint i = 0; i < SUGGEST_COUNT; i++) {
+        const SuggestCandidate *candidate = &suggest->candidates[i];
+        if (suggest->buttons[i] != button || candidate->count == 0) { continue; }
+        gchar buf[SUGGEST_WORD_MAX + 1];
+        gsize len = strlen(candidate->word);
+        if (len <= suggest->word_len) { return; }
+        len -= suggest->word_len;
+        memcpy(buf, candidate->word + suggest->word_len, len);
+        // directories are continued, words are finished
+        if (candidate->word[suggest->word_len + len - 1] != '/') { buf[len++] = ' '; }
+        D printf("suggestion: %s\n", candidate->word);
+        vte_terminal_feed_child(suggest->terminal, buf, (glong) len);
+        return;
+    }
+}
+
+/**
+ * Find index entry of history file
+ * @param suggest Suggest state
+ * @param path History file path
+ * @return Source entry, null if all entries are used
+ */
+static SuggestSource * suggest_source(KTsuggest *suggest, const gchar *path) {
+    const guint32 hash = g_str_hash(path);
+    for (guint i = 0; i < suggest->source_count; i++) {
+        if (suggest->sources[i].hash == hash) {
+            return &suggest->sources[i];
+        }
+    }
+    if (suggest->source_count == SUGGEST_SOURCES_MAX) {
+        return NULL;
+    }
+    SuggestSource *source = &suggest->sources[suggest->source_count++];
+    source->hash = hash;
+    source->offset = 0;
+    return source;
+}
+
+/**
+ * Get shell history file paths
+ * @return Null terminated array of paths, to be freed with g_strfreev()
+ */
+static gchar ** suggest_history_paths(void) {
+    gchar **paths = g_new0(gchar *, SUGGEST_SOURCES_MAX + 1);
+    guint count = 0;
+    const gchar *histfile = getenv("HISTFILE");
+    if (histfile && *histfile) {
+        paths[count++] = g_strdup(histfile);
+    }
+    const gchar *names[] = { ".ash_history", ".bash_history", NULL };
+    for (guint i = 0; names[i] && count < SUGGEST_SOURCES_MAX; i++) {
+        gchar *path = g_build_filename(g_get_home_dir(), names[i], NULL);
+        if (histfile && !strcmp(path, histfile)) {
+            g_free(path);
+            continue;
+        }
+        paths[count++] = path;
+    }
+    return paths;
+}
+
+/**
+ * Start indexing of history files.
+ * History file which shrank was rewritten by shell, then whole index is rebuilt.
+ * @param suggest Suggest state
+ */
+static void suggest_index_start(KTsuggest *suggest) {
+    suggest->index_paths = suggest_history_paths();
+    suggest->index_path = 0;
+    for (guint i = 0; suggest->index_paths[i]; i++) {
+        struct stat st;
+        SuggestSource *source = suggest_source(suggest, suggest->index_paths[i]);
+        if (source && stat(suggest->index_paths[i], &st) == 0 && st.st_size < source->offset) {
+            D printf("history %s rewritten, rebuilding index\n", suggest->index_paths[i]);
+            suggest_clear(suggest);
+            for (guint j = 0; j < suggest->source_count; j++) {
+                suggest->sources[j].offset = 0;
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * Index lines added to history file since last indexing, at most SUGGEST_INDEX_LINES
+ * @param suggest Suggest state
+ * @param path History file path
+ * @param lines Count of lines indexed, increased by lines indexed from this file
+ * @return True if file is indexed up to its end, false if line limit was reached
+ */
+static gboolean suggest_index_file(KTsuggest *suggest, const gchar *path, guint *lines) {
+    SuggestSource *source = suggest_source(suggest, path);
+    FILE *fp = source ? fopen(path, "r") : NULL;
+    if (fp == NULL) {
+        return TRUE;
+    }
+    gboolean done = TRUE;
+    if (fseek(fp, (long) source->offset, SEEK_SET) == 0) {
+        gchar buf[1024];
+        while (fgets(buf, sizeof(buf), fp)) {
+            gsize len = strlen(buf);
+            if (len == 0 || buf[len - 1] != '\n') {
+                // incomplete line is indexed next time
+                break;
+            }
+            suggest_insert_text(suggest, buf, len);
+            source->offset += (gint64) len;
+            if (++(*lines) == SUGGEST_INDEX_LINES) {
+                done = FALSE;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return done;
+}
+
+/**
+ * Index history files in chunks of SUGGEST_INDEX_LINES lines, one chunk per idle callback,
+ * so that input is not blocked while long history is indexed.
+ * Indexed part of each file is kept in its source offset.
+ * @param data Suggest state
+ * @return True while there are lines to index, false to remove source
+ */
+static gboolean suggest_index_history(gpointer data) {
+    KTsuggest *suggest = data;
+    gint64 start = g_get_monotonic_time();
+    if (suggest->index_paths == NULL) {
+        suggest_index_start(suggest);
+    }
+    guint lines = 0;
+    while (suggest->index_paths[suggest->index_path] && lines < SUGGEST_INDEX_LINES) {
+        if (suggest_index_file(suggest, suggest->index_paths[suggest->index_path], &lines)) {
+            suggest->index_path++;
+        }
+    }
+    D printf("history indexed: %u lines, %u nodes in %" G_GINT64_FORMAT " us\n",
+             lines, suggest->nodes->len, g_get_monotonic_time() - start);
+    if (suggest->index_paths[suggest->index_path]) {
+        return TRUE;
+    }
+    g_strfreev(suggest->index_paths);
+    suggest->index_paths = NULL;
+    suggest->index_source = 0;
+    return FALSE;
+}
+
+/**
+ * Load saved index
+ * @param suggest Suggest state
+ * @return True on success, false otherwise
+ */
+static gboolean suggest_index_load(KTsuggest *suggest) {
+    gchar *path = suggest_index_path();
+    gchar *contents = NULL;
+    gsize length = 0;
+    gboolean ret = FALSE;
+    if (g_file_get_contents(path, &contents, &length, NULL)) {
+        SuggestHeader header;
+        memset(&header, 0, sizeof(header));
+        if (length >= sizeof(header)) { memcpy(&header, contents, sizeof(header)); }
+        ret = (header.magic == SUGGEST_MAGIC && header.version == SUGGEST_VERSION
+               && header.node_count && header.node_count <= SUGGEST_NODES_MAX
+               && header.source_count <= SUGGEST_SOURCES_MAX
+               && length == sizeof(header) + header.node_count * sizeof(SuggestNode));
+        // new node is appended after its parent and links to older siblings,
+        // so valid child links point forward and sibling links back
+        for (guint32 i = 0; i < header.node_count && ret; i++) {
+            SuggestNode node;
+            memcpy(&node, contents + sizeof(header) + i * sizeof(SuggestNode), sizeof(node));
+            if ((node.child && (node.child <= i || node.child >= header.node_count))
+                || (node.sibling && node.sibling >= i) || node.byte > G_MAXUINT8) {
+                ret = FALSE;
+            }
+        }
+        if (ret) {
+            g_array_set_size(suggest->nodes, 0);
+            g_array_append_vals(suggest->nodes, contents + sizeof(header), header.node_count);
+            memcpy(suggest->sources, header.sources, sizeof(suggest->sources));
+            suggest->source_count = header.source_count;
+        } else {
+            D printf("suggest index invalid, removing\n");
+            g_unlink(path);
+        }
+    }
+    D printf("suggest index %s: %s\n", ret ? "loaded" : "not loaded", path);
+    g_free(contents);
+    g_free(path);
+    return ret;
+}
+
+/**
+ * Write file readable only by user, replacing existing file at once
+ * @param path File path
+ * @param contents File contents
+ * @param length Contents length
+ * @return True on success, false otherwise
+ */
+static gboolean suggest_write_private(const gchar *path, const gchar *contents, gsize length) {
+    gchar *tmp = g_strconcat(path, ".tmp", NULL);
+    gboolean ret = FALSE;
+    gint fd = g_open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+        ret = (write(fd, contents, length) == (gssize) length);
+        ret = (close(fd) == 0) && ret;
+        ret = ret && g_rename(tmp, path) == 0;
+        if (!ret) { g_unlink(tmp); }
+    }
+    g_free(tmp);
+    return ret;
+}
+
+/**
+ * Save index if changed and saving is enabled (kb_suggest_save).
+ * Index holds words typed in terminal, so it is private to user.
+ * @param suggest Suggest state
+ */
+static void suggest_index_save(KTsuggest *suggest) {
+    if (!suggest->dirty || !conf->kb_suggest_save) {
+        return;
+    }
+    SuggestHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SUGGEST_MAGIC;
+    header.version = SUGGEST_VERSION;
+    header.node_count = suggest->nodes->len;
+    header.source_count = suggest->source_count;
+    memcpy(header.sources, suggest->sources, sizeof(header.sources));
+    const gsize nodes_size = suggest->nodes->len * sizeof(SuggestNode);
+    gchar *contents = g_malloc(sizeof(header) + nodes_size);
+    memcpy(contents, &header, sizeof(header));
+    memcpy(contents + sizeof(header), suggest->nodes->data, nodes_size);
+    gchar *path = suggest_index_path();
+    gchar *dir = g_path_get_dirname(path);
+    if (g_mkdir_with_parents(dir, 0700) != 0 || !suggest_write_private(path, contents, sizeof(header) + nodes_size)) {
+        D printf("Saving suggest index failed: %s\n", path);
+    } else {
+        D printf("suggest index saved: %u nodes\n", suggest->nodes->len);
+    }
+    g_free(dir);
+    g_free(path);
+    g_free(contents);
+}
+
+/**
+ * Build suggestion strip and load index
+ * @param terminal Terminal widget
+ * @param parent Parent box for strip widget
+ * @return Suggest state, to be freed with suggest_free()
+ */
+KTsuggest * suggest_new(GtkWidget *terminal, GtkWidget *parent) {
+    KTsuggest *suggest = g_new0(KTsuggest, 1);
+    suggest->terminal = VTE_TERMINAL(terminal);
+    suggest->nodes = g_array_new(FALSE, TRUE, sizeof(SuggestNode));
+    if (!conf->kb_suggest_save || !suggest_index_load(suggest)) {
+        suggest_clear(suggest);
+    }
+    suggest->dirty = FALSE;
+    // history is indexed when main loop is idle, so that startup is not delayed
+    suggest->index_source = g_idle_add(suggest_index_history, suggest);
+#if GTK_CHECK_VERSION(3,0,0)
+    suggest->widget = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_box_set_homogeneous(GTK_BOX(suggest->widget), TRUE);
+#else
+    suggest->widget = gtk_hbox_new(TRUE, 0);
+#endif
+    gtk_widget_set_name(suggest->widget, "ktermKbSuggest");
+    for (guint i = 0; i < SUGGEST_COUNT; i++) {
+        GtkWidget *button = gtk_button_new_with_label("");
+        gtk_widget_set_name(button, "ktermKbButton");
+        gtk_widget_set_can_focus(button, FALSE);
+        gtk_widget_set_sensitive(button, FALSE);
+        g_signal_connect(button, "clicked", G_CALLBACK(suggest_clicked_cb), suggest);
+        gtk_box_pack_start(GTK_BOX(suggest->widget), button, TRUE, TRUE, 0);
+        suggest->buttons[i] = button;
+    }
+    gtk_box_pack_start(GTK_BOX(parent), suggest->widget, FALSE, FALSE, 0);
+    g_signal_connect(terminal, "commit", G_CALLBACK(suggest_commit_cb), suggest);
+    return suggest;
+}
+
+/**
+ * Save index and free suggest state
+ * @param suggest Suggest state
+ */
+void suggest_free(KTsuggest *suggest) {
+    if (suggest == NULL) {
+        return;
+    }
+    if (suggest->index_source) { g_source_remove(suggest->index_source); }
+    g_strfreev(suggest->index_paths);
+    g_signal_handlers_disconnect_matched(suggest->terminal, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, suggest);
+    suggest_index_save(suggest);
+    g_array_free(suggest->nodes, TRUE);
+    g_free(suggest);
+}
@@ -0,0 +1,33 @@
+/* suggest.h
+ *
+ * This file is part of kterm
+ *
+ * Copyright(C) 2016 Bartek Fabiszewski (www.fabiszewski.net)
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef suggest_h
+#define suggest_h
+
+#include <gtk/gtk.h>
+
+/** Suggestion strip state */
+typedef struct KTsuggest KTsuggest;
+
+KTsuggest * suggest_new(GtkWidget *terminal, GtkWidget *parent);
+void suggest_free(KTsuggest *suggest);
+
+#endif /* suggest_h */